@@ -0,0 +1,810 @@
+#if defined(__x86_64__) || defined(__i386__)
+#define IMG_APNG_SSE2
+#endif
+
+namespace img {
+	static unsigned int apng_be32(const unsigned char* p) {
+		return (unsigned int) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	}
+	
+	/* Blending */
+	
+	// Alpha-blends one 8 bit RGBA pixel over another, as described by the APNG specification.
+	// The products and sums below stay under 2^24, and no quotient comes within 1/65025 of the next integer, so single precision floats produce exactly the same results as integer arithmetic. The SSE2 version relies on this.
+	static inline void apng_over8(unsigned char* d, const unsigned char* s) {
+		unsigned int a = s[3];
+		if (a == 0) return;
+		
+		unsigned int a2 = d[3];
+		if (a == 255 || a2 == 0) {
+			memcpy(d, s, 4);
+			return;
+		}
+		
+		unsigned int u = a * 255;
+		unsigned int v = (255 - a) * a2;
+		unsigned int al = u + v;
+		
+		d[0] = (s[0]*u + d[0]*v) / al;
+		d[1] = (s[1]*u + d[1]*v) / al;
+		d[2] = (s[2]*u + d[2]*v) / al;
+		d[3] = al / 255;
+	}
+	
+	static inline void apng_over16(unsigned char* d, const unsigned char* s) {
+		unsigned long long a = s[6] << 8 | s[7];
+		if (a == 0) return;
+		
+		unsigned long long a2 = d[6] << 8 | d[7];
+		if (a == 65535 || a2 == 0) {
+			memcpy(d, s, 8);
+			return;
+		}
+		
+		unsigned long long u = a * 65535;
+		unsigned long long v = (65535 - a) * a2;
+		unsigned long long al = u + v;
+		unsigned long long c;
+		
+		for (int i = 0; i < 6; i += 2) {
+			c = ((s[i] << 8 | s[i+1]) * u + (d[i] << 8 | d[i+1]) * v) / al;
+			d[i] = c >> 8;
+			d[i+1] = c & 0xFF;
+		}
+		c = al / 65535;
+		d[6] = c >> 8;
+		d[7] = c & 0xFF;
+	}
+
+#ifdef IMG_APNG_SSE2
+	// Blends four pixels at once, with the formula of apng_over8() computed in single precision floats. Lane i of every vector below belongs to pixel i.
+	static inline void apng_over8_sse2(unsigned char* d, const unsigned char* s) {
+		const __m128i byte = _mm_set1_epi32(0xFF);
+		const __m128 f255 = _mm_set1_ps(255.0f);
+		
+		__m128i sv = _mm_loadu_si128((const __m128i*) s);
+		__m128i dv = _mm_loadu_si128((const __m128i*) d);
+		
+		__m128i ai = _mm_srli_epi32(sv, 24);
+		__m128 a = _mm_cvtepi32_ps(ai);
+		__m128 a2 = _mm_cvtepi32_ps(_mm_srli_epi32(dv, 24));
+		
+		// Where the source is opaque or the destination is transparent, v is 0 and the quotients are exactly the source samples, so only transparent source pixels need to be handled apart.
+		__m128 u = _mm_mul_ps(a, f255);
+		__m128 v = _mm_mul_ps(_mm_sub_ps(f255, a), a2);
+		__m128 al = _mm_add_ps(u, v);
+		__m128i clear = _mm_cmpeq_epi32(ai, _mm_setzero_si128());
+		al = _mm_or_ps(_mm_andnot_ps(_mm_castsi128_ps(clear), al), _mm_and_ps(_mm_castsi128_ps(clear), _mm_set1_ps(1.0f)));
+		
+		__m128i r = _mm_slli_epi32(_mm_cvttps_epi32(_mm_div_ps(al, f255)), 24);
+		__m128 sc;
+		__m128 dc;
+		for (int c = 0; c < 3; c++) {
+			sc = _mm_cvtepi32_ps(_mm_and_si128(sv, byte));
+			dc = _mm_cvtepi32_ps(_mm_and_si128(dv, byte));
+			r = _mm_or_si128(r, _mm_slli_epi32(_mm_cvttps_epi32(_mm_div_ps(_mm_add_ps(_mm_mul_ps(sc, u), _mm_mul_ps(dc, v)), al)), 8 * c));
+			sv = _mm_srli_epi32(sv, 8);
+			dv = _mm_srli_epi32(dv, 8);
+		}
+		
+		dv = _mm_loadu_si128((const __m128i*) d);
+		r = _mm_or_si128(_mm_and_si128(clear, dv), _mm_andnot_si128(clear, r));
+		_mm_storeu_si128((__m128i*) d, r);
+	}
+#endif
+
+	// Blend a row of n pixels over another. 16 bit pixels are always blended one at a time: their products need more precision than single precision floats have, and SSE2 has no packed 64 bit division.
+	static void apng_over_row(unsigned char* d, const unsigned char* s, size_t n, unsigned char bit_depth) {
+		size_t i = 0;
+		
+		if (bit_depth == 16) {
+			for (; i < n; i++) {
+				apng_over16(d + 8*i, s + 8*i);
+			}
+			return;
+		}
+
+#ifdef IMG_APNG_SSE2
+		// Stickers are mostly fully opaque or fully transparent, so four pixels are checked at a time and copied or skipped as a whole.
+		const __m128i alpha = _mm_set1_epi32(0xFF000000);
+		__m128i sv;
+		int opaque, clear;
+		
+		for (; i + 4 <= n; i += 4) {
+			sv = _mm_loadu_si128((const __m128i*) (s + 4*i));
+			opaque = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(sv, alpha), alpha)) & 0x8888;
+			clear = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(sv, alpha), _mm_setzero_si128())) & 0x8888;
+			
+			if (opaque == 0x8888) {
+				_mm_storeu_si128((__m128i*) (d + 4*i), sv);
+			}
+			else if (clear != 0x8888) {
+				apng_over8_sse2(d + 4*i, s + 4*i);
+			}
+		}
+#endif
+
+		for (; i < n; i++) {
+			apng_over8(d + 4*i, s + 4*i);
+		}
+	}
+	
+	/* apng_frame */
+	
+	apng_frame::apng_frame() : width(0), height(0), x_offset(0), y_offset(0), delay_num(0), delay_den(0), dispose_op(APNG_DISPOSE_NONE), blend_op(APNG_BLEND_SOURCE), keyframe(false), zdata(NULL), zlen(0), px(NULL) {}
+	
+	/* apng_rgba_sink */
+	
+	apng_rgba_sink::apng_rgba_sink(unsigned char* dst, size_t pitch, unsigned char color_type, unsigned char bit_depth, const unsigned char* palette, int palette_length, const unsigned char* trns, int trns_length, const unsigned short* trns_key) : dst(dst), pitch(pitch), color_type(color_type), bit_depth(bit_depth), palette(palette), palette_length(palette_length), trns(trns), trns_length(trns_length), trns_key(trns_key) {}
+	
+	unsigned int apng_rgba_sink::sample(const unsigned char* px, size_t k) {
+		if (bit_depth == 16) {
+			return px[2*k] << 8 | px[2*k + 1];
+		}
+		if (bit_depth == 8) {
+			return px[k];
+		}
+		
+		size_t bit = k * bit_depth;
+		return (px[bit / 8] >> (8 - bit_depth - bit % 8)) & ((1 << bit_depth) - 1);
+	}
+	
+	void apng_rgba_sink::row(const png_pass& pass, unsigned int y, const unsigned char* px) {
+		unsigned char* out = dst + (size_t) (pass.y0 + y * pass.dy) * pitch;
+		unsigned char* o;
+		
+		unsigned int v[4];
+		unsigned int max = (1 << bit_depth) - 1;
+		unsigned int idx;
+		int c;
+		
+		for (unsigned int i = 0; i < pass.width; i++) {
+			switch (color_type) {
+				// Grayscale
+				case 0:
+					v[0] = sample(px, i);
+					v[3] = trns_length > 0 && v[0] == trns_key[0] ? 0 : max;
+					v[1] = v[2] = v[0];
+					break;
+				// RGB
+				case 2:
+					v[0] = sample(px, 3*i);
+					v[1] = sample(px, 3*i + 1);
+					v[2] = sample(px, 3*i + 2);
+					v[3] = trns_length > 0 && v[0] == trns_key[0] && v[1] == trns_key[1] && v[2] == trns_key[2] ? 0 : max;
+					break;
+				// Palette. Palette entries are always 8 bits, out of range indices are black.
+				case 3:
+					idx = sample(px, i);
+					if ((int) idx < palette_length) {
+						v[0] = palette[3*idx];
+						v[1] = palette[3*idx + 1];
+						v[2] = palette[3*idx + 2];
+					} else {
+						v[0] = v[1] = v[2] = 0;
+					}
+					v[3] = (int) idx < trns_length ? trns[idx] : 255;
+					break;
+				// Grayscale and alpha
+				case 4:
+					v[0] = v[1] = v[2] = sample(px, 2*i);
+					v[3] = sample(px, 2*i + 1);
+					break;
+				// RGBA
+				default:
+					v[0] = sample(px, 4*i);
+					v[1] = sample(px, 4*i + 1);
+					v[2] = sample(px, 4*i + 2);
+					v[3] = sample(px, 4*i + 3);
+			}
+			
+			if (bit_depth == 16) {
+				o = out + (size_t) (pass.x0 + i * pass.dx) * 8;
+				for (c = 0; c < 4; c++) {
+					o[2*c] = v[c] >> 8;
+					o[2*c + 1] = v[c] & 0xFF;
+				}
+			} else {
+				o = out + (size_t) (pass.x0 + i * pass.dx) * 4;
+				
+				// Gray samples below 8 bits are scaled up to the full range.
+				if (bit_depth < 8 && color_type == 0) {
+					v[0] = v[1] = v[2] = v[0] * 255 / max;
+					v[3] = v[3] == 0 ? 0 : 255;
+				}
+				for (c = 0; c < 4; c++) {
+					o[c] = v[c];
+				}
+			}
+		}
+	}
+	
+	/* apng */
+	
+	apng::apng() : num_frames(0), frames(NULL), threads(0), keep_frames(false), current(-1), palette(NULL), palette_length(0), trns(NULL), trns_length(0), saved(NULL), pool_stop(false), helpers(0), busy(0), helping(0), failed(0) {}
+	
+	apng* apng::load_apng(char* fn, apng& an, int verbose, int* errcd) {
+		*errcd = 0;
+		
+		FILE* fp = fopen(fn, "rb");
+		if (fp == NULL) {
+			if (verbose >= 3) printf("Error Loading \"%s\": Failed to open file.\n", fn);
+			*errcd = -1; return NULL;
+		}
+		
+		// The whole file is read at once. Frame data has to be kept until the frames are decoded anyway.
+		fseeko(fp, 0, SEEK_END);
+		size_t fsize = ftello(fp);
+		fseeko(fp, 0, SEEK_SET);
+		
+		unsigned char* file = (unsigned char*) malloc(fsize > 0 ? fsize : 1);
+		if (file == NULL) {
+			if (verbose >= 3) printf("Error While Loading \"%s\": Failed to allocate %zu bytes for the file.\n", fn, fsize);
+			fclose(fp);
+			*errcd = -6; return NULL;
+		}
+		
+		size_t got = fread(file, 1, fsize, fp);
+		fclose(fp);
+		
+		static const unsigned char signature[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+		if (got < 8 || memcmp(file, signature, 4) != 0) {
+			if (verbose >= 3) printf("Error While Loading \"%s\": File does not appear to be a PNG file.\n", fn);
+			free(file);
+			*errcd = -2; return NULL;
+		}
+		if (memcmp(file + 4, signature + 4, 4) != 0) {
+			if (verbose >= 3) printf("Error While Loading \"%s\": This PNG file appears to be corrupted.\n", fn);
+			free(file);
+			*errcd = -3; return NULL;
+		}
+		
+		size_t pos = 8;
+		unsigned int len;
+		unsigned int type;
+		unsigned char* data;
+		char name[5];
+		name[4] = 0;
+		
+		bool found_IHDR = false;
+		bool found_acTL = false;
+		bool found_IDAT = false;
+		bool found_IEND = false;
+		
+		// Frame count announced by acTL, the sequence number expected in the next fcTL or fdAT chunk, and the frame whose data is being gathered.
+		unsigned int declared_frames = 0;
+		unsigned int next_seq = 0;
+		apng_frame* f = NULL;
+		
+		// Whether f gets its data from fdAT chunks rather than the IDAT chunks.
+		bool f_fdat = false;
+		
+		an.default_is_frame = false;
+		an.num_plays = 0;
+		
+		while (*errcd == 0 && !found_IEND) {
+			if (got - pos < 12) {
+				if (verbose >= 3) printf("Error While Loading \"%s\": Encountered End Of File before finding an IEND chunk.\n", fn);
+				*errcd = -3;
+				break;
+			}
+			
+			len = apng_be32(file + pos);
+			type = apng_be32(file + pos + 4);
+			memcpy(name, file + pos + 4, 4);
+			data = file + pos + 8;
+			
+			if (len > got - pos - 12) {
+				if (verbose >= 3) printf("Error While Loading \"%s\": Chunk \"%s\" runs past the end of the file.\n", fn, name);
+				*errcd = -3;
+				break;
+			}
+			
+			pos += (size_t) len + 12;
+			
+			// The animation chunks are ancillary by name, but without them the animation cannot be played correctly, so they are treated as critical.
+			if ((unsigned int) img::png_crc(data - 4, len + 4) != apng_be32(data + len)) {
+				if (!(name[0] & 0x20) || type == img::acTL || type == img::fcTL || type == img::fdAT) {
+					if (verbose >= 3) printf("Error While Loading \"%s\": CRC Check failed on critical chunk \"%s\".\n", fn, name);
+					*errcd = -5;
+				} else {
+					if (verbose >= 2) printf("Warning While Loading \"%s\": CRC Check failed on ancillary chunk \"%s\". Skipping chunk.\n", fn, name);
+				}
+				continue;
+			}
+			
+			if (!found_IHDR) {
+				if (type != img::IHDR || len != 13) {
+					if (verbose >= 3) printf("Error While Loading \"%s\": File is missing an IHDR chunk.\n", fn);
+					*errcd = -5;
+					break;
+				}
+				found_IHDR = true;
+				
+				an.width = apng_be32(data);
+				an.height = apng_be32(data + 4);
+				an.bit_depth = data[8];
+				an.color_type = data[9];
+				an.interlaced = data[12] == 1;
+				
+				bool valid;
+				switch (an.color_type) {
+					case 0:
+						valid = an.bit_depth == 1 || an.bit_depth == 2 || an.bit_depth == 4 || an.bit_depth == 8 || an.bit_depth == 16;
+						break;
+					case 3:
+						valid = an.bit_depth == 1 || an.bit_depth == 2 || an.bit_depth == 4 || an.bit_depth == 8;
+						break;
+					case 2:
+					case 4:
+					case 6:
+						valid = an.bit_depth == 8 || an.bit_depth == 16;
+						break;
+					default:
+						valid = false;
+				}
+				
+				if (!valid || data[10] != 0 || data[11] != 0 || data[12] > 1) {
+					if (verbose >= 3) printf("Error While Loading \"%s\": PNG Header specifies an unrecognized color type, bit depth, compression, filtering or interlacing method.\n", fn);
+					*errcd = -4;
+					break;
+				}
+				
+				an.canvas.bpp = an.bit_depth == 16 ? 8 : 4;
+				if (an.width == 0 || an.height == 0 || an.width > SIZE_MAX / an.canvas.bpp / an.height) {
+					if (verbose >= 3) printf("Error While Loading \"%s\": Image size of %ux%u is invalid or too large to be addressed on this system.\n", fn, an.width, an.height);
+					*errcd = -4;
+					break;
+				}
+				continue;
+			}
+			
+			if (type == img::acTL) {
+				if (len != 8 || found_IDAT || found_acTL || apng_be32(data) == 0) {
+					if (verbose >= 3) printf("Error While Loading \"%s\": Invalid or misplaced acTL chunk.\n", fn);
+					*errcd = -5;
+					break;
+				}
+				found_acTL = true;
+				declared_frames = apng_be32(data);
+				an.num_plays = apng_be32(data + 4);
+			}
+			else if (type == img::fcTL && found_acTL) {
+				if (len != 26 || apng_be32(data) != next_seq++) {
+					if (verbose >= 3) printf("Error While Loading \"%s\": Invalid fcTL chunk or sequence number.\n", fn);
+					*errcd = -5;
+					break;
+				}
+				if (an.num_frames == declared_frames || (f != NULL && f->zlen == 0)) {
+					if (verbose >= 3) printf("Error While Loading \"%s\": Found more frames than announced, or a frame without image data.\n", fn);
+					*errcd = -3;
+					break;
+				}
+				
+				apng_frame* grown = (apng_frame*) realloc(an.frames, (an.num_frames + 1) * sizeof(apng_frame));
+				if (grown == NULL) {
+					if (verbose >= 3) printf("Error While Loading \"%s\": Failed to allocate memory for frame %u.\n", fn, an.num_frames);
+					*errcd = -6;
+					break;
+				}
+				an.frames = grown;
+				f = new (an.frames + an.num_frames) apng_frame();
+				an.num_frames++;
+				
+				f->width = apng_be32(data + 4);
+				f->height = apng_be32(data + 8);
+				f->x_offset = apng_be32(data + 12);
+				f->y_offset = apng_be32(data + 16);
+				f->delay_num = data[20] << 8 | data[21];
+				f->delay_den = data[22] << 8 | data[23];
+				f->dispose_op = data[24];
+				f->blend_op = data[25];
+				
+				// An fcTL before the IDAT chunks makes the default image the first frame, which has to cover the whole canvas.
+				f_fdat = found_IDAT;
+				if (!found_IDAT) {
+					an.default_is_frame = true;
+				}
+				
+				if (f->width == 0 || f->height == 0 || f->x_offset > an.width || f->width > an.width - f->x_offset || f->y_offset > an.height || f->height > an.height - f->y_offset
+				 || f->dispose_op > APNG_DISPOSE_PREVIOUS || f->blend_op > APNG_BLEND_OVER || (!f_fdat && (f->x_offset != 0 || f->y_offset != 0 || f->width != an.width || f->height != an.height))) {
+					if (verbose >= 3) printf("Error While Loading \"%s\": Frame %u lies outside the canvas or has an invalid dispose or blend operation.\n", fn, an.num_frames - 1);
+					*errcd = -5;
+					break;
+				}
+			}
+			else if (type == img::IDAT || (type == img::fdAT && found_acTL)) {
+				unsigned char* src = data;
+				size_t n = len;
+				
+				if (type == img::IDAT) {
+					found_IDAT = true;
+					
+					// A plain PNG file is a single frame covering the canvas.
+					if (!found_acTL && f == NULL) {
+						an.frames = (apng_frame*) malloc(sizeof(apng_frame));
+						f = new (an.frames) apng_frame();
+						an.num_frames = 1;
+						an.default_is_frame = true;
+						f->width = an.width;
+						f->height = an.height;
+					}
+					
+					if (!an.default_is_frame) continue;
+				}
+				else {
+					if (len < 4 || apng_be32(data) != next_seq++ || f == NULL || !f_fdat) {
+						if (verbose >= 3) printf("Error While Loading \"%s\": Invalid fdAT chunk or sequence number.\n", fn);
+						*errcd = -5;
+						break;
+					}
+					src += 4;
+					n -= 4;
+				}
+				
+				unsigned char* grown = (unsigned char*) realloc(f->zdata, f->zlen + n + 1);
+				if (grown == NULL) {
+					if (verbose >= 3) printf("Error While Loading \"%s\": Failed to allocate memory for frame data.\n", fn);
+					*errcd = -6;
+					break;
+				}
+				f->zdata = grown;
+				memcpy(f->zdata + f->zlen, src, n);
+				f->zlen += n;
+			}
+			else if (type == img::PLTE) {
+				if (len % 3 != 0 || len / 3 > 256 || an.palette != NULL) {
+					if (verbose >= 3) printf("Error While Loading \"%s\": PNG PLTE chunk is of an invalid length.\n", fn);
+					*errcd = -5;
+					break;
+				}
+				an.palette_length = len / 3;
+				an.palette = (unsigned char*) malloc(len);
+				memcpy(an.palette, data, len);
+			}
+			else if (type == img::tRNS) {
+				if (an.color_type == 3 && len <= 256) {
+					an.trns_length = len;
+					an.trns = (unsigned char*) malloc(len > 0 ? len : 1);
+					memcpy(an.trns, data, len);
+				}
+				else if ((an.color_type == 0 && len == 2) || (an.color_type == 2 && len == 6)) {
+					an.trns_length = len;
+					for (unsigned int i = 0; i < len / 2; i++) {
+						an.trns_key[i] = data[2*i] << 8 | data[2*i + 1];
+					}
+				}
+				else if (verbose >= 2) {
+					printf("Warning While Loading \"%s\": Ignoring tRNS chunk which does not match the color type.\n", fn);
+				}
+			}
+			else if (type == img::IEND) {
+				found_IEND = true;
+			}
+		}
+		
+		free(file);
+		
+		if (*errcd == 0) {
+			if (!found_IDAT || an.num_frames == 0 || an.frames[an.num_frames - 1].zlen == 0) {
+				if (verbose >= 3) printf("Error While Loading \"%s\": File contains no image data, or a frame without image data.\n", fn);
+				*errcd = -3;
+			}
+			else if (found_acTL && an.num_frames != declared_frames) {
+				if (verbose >= 3) printf("Error While Loading \"%s\": acTL announces %u frames, but %u were found.\n", fn, declared_frames, an.num_frames);
+				*errcd = -3;
+			}
+			else if (an.color_type == 3 && an.palette == NULL) {
+				if (verbose >= 3) printf("Error While Loading \"%s\": Palette image is missing its PLTE chunk.\n", fn);
+				*errcd = -5;
+			}
+		}
+		
+		if (*errcd != 0) {
+			return NULL;
+		}
+		
+		// The first frame has nothing to restore to, so the specification says to clear it instead.
+		if (an.frames[0].dispose_op == APNG_DISPOSE_PREVIOUS) {
+			an.frames[0].dispose_op = APNG_DISPOSE_BACKGROUND;
+		}
+		
+		// A frame is a keyframe if nothing drawn before it can show through: it is the first frame, or it replaces the whole canvas (and the frame after it never goes back to what was there before), or the frame before it covered the whole canvas and was cleared.
+		bool uses_previous = false;
+		apng_frame* p;
+		for (unsigned int i = 0; i < an.num_frames; i++) {
+			f = an.frames + i;
+			p = an.frames + i - 1;
+			
+			f->keyframe = i == 0
+			 || (f->x_offset == 0 && f->y_offset == 0 && f->width == an.width && f->height == an.height && f->blend_op == APNG_BLEND_SOURCE && f->dispose_op != APNG_DISPOSE_PREVIOUS)
+			 || (p->x_offset == 0 && p->y_offset == 0 && p->width == an.width && p->height == an.height && p->dispose_op == APNG_DISPOSE_BACKGROUND);
+			
+			if (f->dispose_op == APNG_DISPOSE_PREVIOUS) uses_previous = true;
+		}
+		
+		an.canvas.width = an.width;
+		an.canvas.height = an.height;
+		an.canvas.pitch = (size_t) an.width * an.canvas.bpp;
+		an.canvas.bsize = an.canvas.pitch * an.height;
+		an.canvas.is_RGB = true;
+		an.canvas.uses_palette = false;
+		an.canvas.alpha_mode = 1;
+		an.canvas.bit_depth = an.bit_depth == 16 ? 16 : 8;
+		an.canvas.palette_length = 0;
+		an.canvas.data = (unsigned char*) calloc(an.canvas.bsize, 1);
+		an.canvas.data_mode = 0;
+		
+		if (uses_previous) {
+			an.saved = (unsigned char*) malloc(an.canvas.bsize);
+		}
+		
+		if (an.canvas.data == NULL || (uses_previous && an.saved == NULL)) {
+			if (verbose >= 3) printf("Error While Loading \"%s\": Failed to allocate %zu bytes for the canvas.\n", fn, an.canvas.bsize);
+			*errcd = -6;
+			return NULL;
+		}
+		
+		an.current = -1;
+		return &an;
+	}
+	
+	unsigned int apng::workers() {
+		unsigned int n = threads;
+		if (n == 0) n = std::thread::hardware_concurrency();
+		if (n == 0) n = 1;
+		return n;
+	}
+	
+	int apng::decode_frame(unsigned int i) {
+		apng_frame& f = frames[i];
+		
+		size_t pitch = (size_t) f.width * canvas.bpp;
+		unsigned char* px = (unsigned char*) malloc(pitch * f.height);
+		if (px == NULL) return -6;
+		
+		unsigned char channels;
+		switch (color_type) {
+			case 2:
+				channels = 3;
+				break;
+			case 4:
+				channels = 2;
+				break;
+			case 6:
+				channels = 4;
+				break;
+			default:
+				channels = 1;
+		}
+		
+		// The frame is inflated in one go into a memory buffer, then unfiltered.
+		FILE* in = fmemopen(f.zdata, f.zlen, "rb");
+		char* buf = NULL;
+		size_t buf_size = 0;
+		FILE* out = open_memstream(&buf, &buf_size);
+		
+		util::zlib_stream z(in, out);
+		bool ok = z.inflate(f.zlen);
+		z.close_in();
+		z.close_out();
+		
+		int ret = 0;
+		if (!ok) {
+			ret = -5;
+		} else {
+			apng_rgba_sink sink(px, pitch, color_type, bit_depth, palette, palette_length, trns, trns_length, trns_key);
+			png_scanlines lines(f.width, f.height, channels * bit_depth, interlaced, &sink);
+			
+			if (!lines.push((unsigned char*) buf, buf_size)) {
+				ret = -5;
+			} else if (!lines.done()) {
+				ret = -3;
+			}
+		}
+		
+		free(buf);
+		
+		if (ret != 0) {
+			free(px);
+		} else {
+			f.px = px;
+		}
+		return ret;
+	}
+	
+	bool apng::decode_frames(unsigned int first, unsigned int last, int* errcd) {
+		*errcd = 0;
+		
+		if (first > last || last >= num_frames) {
+			*errcd = -4;
+			return false;
+		}
+		
+		std::unique_lock<std::mutex> l(pool_lock);
+		for (unsigned int i = first; i <= last; i++) {
+			if (frames[i].px == NULL) queue.push_back(i);
+		}
+		if (queue.empty()) return true;
+		
+		unsigned int n = workers();
+		if (n > queue.size()) n = queue.size();
+		
+		// Threads are only ever added to the pool. If threads has been lowered, the extra ones stay idle.
+		while (pool.size() + 1 < n) {
+			pool.emplace_back(&apng::pool_run, this);
+		}
+		helpers = n - 1;
+		failed = 0;
+		pool_wake.notify_all();
+		
+		// Every thread takes the next frame from the queue until none are left. The first error is reported.
+		while (!queue.empty()) {
+			decode_queued(l, false);
+		}
+		while (busy > 0) {
+			pool_idle.wait(l);
+		}
+		helpers = 0;
+		
+		*errcd = failed;
+		return *errcd == 0;
+	}
+	
+	void apng::decode_queued(std::unique_lock<std::mutex>& l, bool helper) {
+		unsigned int i = queue.front();
+		queue.pop_front();
+		busy++;
+		if (helper) helping++;
+		
+		l.unlock();
+		int ret = decode_frame(i);
+		l.lock();
+		
+		busy--;
+		if (helper) helping--;
+		if (ret != 0 && failed == 0) failed = ret;
+		if (busy == 0) pool_idle.notify_all();
+	}
+	
+	void apng::pool_run() {
+		std::unique_lock<std::mutex> l(pool_lock);
+		
+		while (true) {
+			while (!pool_stop && (queue.empty() || helping >= helpers)) {
+				pool_wake.wait(l);
+			}
+			if (pool_stop) return;
+			
+			decode_queued(l, true);
+		}
+	}
+	
+	void apng::reset() {
+		memset(canvas.data, 0, canvas.bsize);
+		current = -1;
+	}
+	
+	void apng::composite(unsigned int i) {
+		apng_frame& f = frames[i];
+		size_t bpp = canvas.bpp;
+		size_t row = f.width * bpp;
+		unsigned char* area = canvas.data + f.y_offset * canvas.pitch + f.x_offset * bpp;
+		unsigned int y;
+		
+		if (current >= 0) {
+			apng_frame& p = frames[current];
+			size_t prow = p.width * bpp;
+			unsigned char* parea = canvas.data + p.y_offset * canvas.pitch + p.x_offset * bpp;
+			
+			if (p.dispose_op == APNG_DISPOSE_BACKGROUND) {
+				for (y = 0; y < p.height; y++) {
+					memset(parea + y * canvas.pitch, 0, prow);
+				}
+			}
+			else if (p.dispose_op == APNG_DISPOSE_PREVIOUS) {
+				for (y = 0; y < p.height; y++) {
+					memcpy(parea + y * canvas.pitch, saved + y * prow, prow);
+				}
+			}
+		}
+		
+		if (f.dispose_op == APNG_DISPOSE_PREVIOUS) {
+			for (y = 0; y < f.height; y++) {
+				memcpy(saved + y * row, area + y * canvas.pitch, row);
+			}
+		}
+		
+		for (y = 0; y < f.height; y++) {
+			if (f.blend_op == APNG_BLEND_SOURCE) {
+				memcpy(area + y * canvas.pitch, f.px + y * row, row);
+			} else {
+				apng_over_row(area + y * canvas.pitch, f.px + y * row, f.width, canvas.bit_depth);
+			}
+		}
+		
+		current = i;
+		
+		if (!keep_frames) {
+			free(f.px);
+			f.px = NULL;
+		}
+	}
+	
+	const img* apng::seek(unsigned int n, int* errcd) {
+		*errcd = 0;
+		
+		if (n >= num_frames || canvas.data == NULL) {
+			*errcd = -4;
+			return NULL;
+		}
+		if (current == (int) n) return &canvas;
+		
+		unsigned int k = n;
+		while (!frames[k].keyframe) k--;
+		
+		// Carry on from the frame on the canvas if it lies between the keyframe and n.
+		bool resume = current >= (int) k && current < (int) n;
+		unsigned int start = resume ? current + 1 : k;
+		
+		// Frames decoded ahead by next() are only worth keeping while they are still ahead. When the animation jumps, the ones which are neither composited now nor within the next read-ahead are freed.
+		if (!keep_frames && (int) n != current + 1) {
+			unsigned int ahead = workers();
+			for (unsigned int i = 0; i < num_frames; i++) {
+				if ((i < start || i > n) && (i < n || i - n >= ahead)) {
+					free(frames[i].px);
+					frames[i].px = NULL;
+				}
+			}
+		}
+		
+		if (!decode_frames(start, n, errcd)) return NULL;
+		
+		if (!resume) reset();
+		for (unsigned int i = start; i <= n; i++) {
+			composite(i);
+		}
+		
+		return &canvas;
+	}
+	
+	const img* apng::next(int* errcd) {
+		*errcd = 0;
+		
+		if (num_frames == 0) {
+			*errcd = -4;
+			return NULL;
+		}
+		
+		unsigned int n = current + 1 < (int) num_frames ? current + 1 : 0;
+		
+		if (frames[n].px == NULL) {
+			unsigned int last = n + workers() - 1;
+			if (last >= num_frames || last < n) last = num_frames - 1;
+			
+			if (!decode_frames(n, last, errcd)) return NULL;
+		}
+		
+		return seek(n, errcd);
+	}
+	
+	apng::~apng() {
+		{
+			std::lock_guard<std::mutex> l(pool_lock);
+			pool_stop = true;
+			pool_wake.notify_all();
+		}
+		for (size_t t = 0; t < pool.size(); t++) {
+			pool[t].join();
+		}
+		
+		for (unsigned int i = 0; i < num_frames; i++) {
+			free(frames[i].zdata);
+			free(frames[i].px);
+		}
+		free(frames);
+		free(palette);
+		free(trns);
+		free(saved);
+	}
+}
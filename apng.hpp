@@ -0,0 +1,182 @@
+#ifndef img_apng
+#define img_apng
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#endif
+
+#include "img.hpp"
+
+// Animated PNGs are decoded frame by frame onto an RGBA canvas. The canvas has 8 bit samples, or 16 bit samples (stored big-endian as in PNG) if the file has a bit depth of 16.
+// Plain PNG files are read as an animation of a single frame.
+// The same error codes as img.hpp are used.
+
+namespace img {
+	// How the area of a frame is treated before the next frame is drawn: left as it is, cleared to transparent black, or restored to what it was before the frame was drawn.
+	enum apng_dispose {APNG_DISPOSE_NONE, APNG_DISPOSE_BACKGROUND, APNG_DISPOSE_PREVIOUS};
+	
+	// Whether a frame replaces the pixels under it or is alpha-blended over them.
+	enum apng_blend {APNG_BLEND_SOURCE, APNG_BLEND_OVER};
+	
+	class apng_frame {
+	public:
+		// Area of the canvas covered by this frame.
+		unsigned int width;
+		unsigned int height;
+		unsigned int x_offset;
+		unsigned int y_offset;
+		
+		// The frame is shown for delay_num / delay_den seconds. A delay_den of 0 means hundredths of a second.
+		unsigned short delay_num;
+		unsigned short delay_den;
+		
+		unsigned char dispose_op;
+		unsigned char blend_op;
+		
+		// Whether the canvas can be rebuilt from this frame onwards, starting from a transparent canvas. apng::seek() never composites frames before the last keyframe.
+		bool keyframe;
+		
+		// Compressed image data of the frame, gathered from its IDAT or fdAT chunks.
+		unsigned char* zdata;
+		size_t zlen;
+		
+		// The frame converted to RGBA, with the sample size of the canvas. NULL until the frame has been decoded.
+		unsigned char* px;
+		
+		apng_frame();
+	};
+	
+	class apng {
+	public:
+		// Sets pointers to NULL, threads to 0 and keep_frames to false.
+		apng();
+		
+		// Size of the canvas.
+		unsigned int width;
+		unsigned int height;
+		
+		unsigned int num_frames;
+		apng_frame* frames;
+		
+		// Number of times the animation is meant to be played, 0 means forever.
+		unsigned int num_plays;
+		
+		// Whether the default image (the IDAT chunks) is the first frame of the animation. If not, it is only shown by decoders without APNG support and is not decoded here.
+		bool default_is_frame;
+		
+		// Number of threads decode_frames() inflates and unfilters frames on. 0 uses one per hardware thread, 1 decodes every frame in the calling thread.
+		unsigned int threads;
+		
+		// Keep decoded frames after they have been composited, so that playing the animation again does not decode them again. This costs the RGBA size of every frame in memory.
+		bool keep_frames;
+		
+		// The composited image, an RGBA img. Its contents are those of frame current.
+		img canvas;
+		
+		// Index of the frame on the canvas, -1 before the first call to next() or seek().
+		int current;
+		
+		// Read an APNG (or PNG) file. Chunks are parsed and checked, but frames are only decoded as they are needed.
+		// Returns &an on success. On failure, returns NULL and sets errcd.
+		static apng* load_apng(char* fn, apng& an, int verbose, int* errcd);
+		
+		// Decode frames first to last (inclusive) which have not been decoded yet. Frames do not depend on each other until they are composited, so they are decoded concurrently.
+		// Returns false and sets errcd if any of them fails.
+		bool decode_frames(unsigned int first, unsigned int last, int* errcd);
+		
+		// Composite the frame after current and return the canvas. After the last frame, starts over at frame 0.
+		// Decodes the following frames ahead, one per thread, whenever it reaches a frame which has not been decoded.
+		const img* next(int* errcd);
+		
+		// Composite frame n and return the canvas. Only the frames since the last keyframe at or before n are composited, or those since current if that is closer.
+		// Unless keep_frames is set, frames which were decoded ahead by next() and are no longer ahead of n are freed.
+		const img* seek(unsigned int n, int* errcd);
+		
+		~apng();
+		
+	private:
+		// Format of the image data, from the IHDR, PLTE and tRNS chunks.
+		unsigned char color_type;
+		unsigned char bit_depth;
+		bool interlaced;
+		
+		unsigned char* palette;
+		int palette_length;
+		
+		// tRNS contents. For palette images one alpha value per entry, otherwise the gray or RGB sample value which is transparent, as 16 bit numbers.
+		unsigned char* trns;
+		int trns_length;
+		unsigned short trns_key[3];
+		
+		// Copy of the canvas area of the frame on the canvas, if its dispose_op is APNG_DISPOSE_PREVIOUS.
+		unsigned char* saved;
+		
+		// Number of threads to decode frames on.
+		unsigned int workers();
+		
+		// Helper threads for decode_frames(), which decodes frames on the calling thread as well. They are started the first time they are needed, kept for later calls, and stopped by the destructor.
+		std::vector<std::thread> pool;
+		std::mutex pool_lock;
+		std::condition_variable pool_wake;
+		std::condition_variable pool_idle;
+		bool pool_stop;
+		
+		// Frames waiting to be decoded, and how many helpers may take them during the current call, since threads may have been lowered since the pool was started.
+		std::deque<unsigned int> queue;
+		unsigned int helpers;
+		
+		// Frames being decoded by any thread, and how many of them by helpers. The first error of the current call.
+		unsigned int busy;
+		unsigned int helping;
+		int failed;
+		
+		// Body of each helper thread.
+		void pool_run();
+		
+		// Take one frame off the queue and decode it, with pool_lock held by l except while decoding.
+		void decode_queued(std::unique_lock<std::mutex>& l, bool helper);
+		
+		// Inflate and unfilter one frame into frames[i].px. Returns 0 or an error code. Safe to call for different frames at once.
+		int decode_frame(unsigned int i);
+		
+		// Draw frames[i] over the canvas, after disposing of the frame which is on it.
+		void composite(unsigned int i);
+		
+		// Clear the canvas to transparent black and forget the frame on it.
+		void reset();
+	};
+	
+	// Converts decoded rows to RGBA and scatters them into a frame buffer, placing the rows of Adam-7 passes at their positions in the frame.
+	class apng_rgba_sink : public png_row_sink {
+	public:
+		apng_rgba_sink(unsigned char* dst, size_t pitch, unsigned char color_type, unsigned char bit_depth, const unsigned char* palette, int palette_length, const unsigned char* trns, int trns_length, const unsigned short* trns_key);
+		
+		void row(const png_pass& pass, unsigned int y, const unsigned char* px);
+		
+	private:
+		unsigned char* dst;
+		size_t pitch;
+		unsigned char color_type;
+		unsigned char bit_depth;
+		
+		const unsigned char* palette;
+		int palette_length;
+		const unsigned char* trns;
+		int trns_length;
+		const unsigned short* trns_key;
+		
+		// Returns sample k of a row.
+		unsigned int sample(const unsigned char* px, size_t k);
+	};
+}
+
+#include "apng.cpp"
+
+#endif
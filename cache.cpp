@@ -0,0 +1,176 @@
+#define IMG_CACHE_HASH_BLOCK 65536
+
+namespace img {
+	cache::cache(size_t budget, const png_opts& opts) : hash_keys(false), opts(opts), budget(budget) {
+		// Every cached image needs memory of its own.
+		this->opts.out_fn = NULL;
+		this->opts.out_map = NULL;
+		
+		counts.hits = 0;
+		counts.misses = 0;
+		counts.waits = 0;
+		counts.evictions = 0;
+		counts.entries = 0;
+		counts.bytes = 0;
+	}
+	
+	std::shared_ptr<const img> cache::load(char* fn, int verbose, int* errcd) {
+		*errcd = 0;
+		
+		std::string path(fn);
+		std::string version;
+		if (!file_version(fn, version)) {
+			if (verbose >= 3) printf("Error Loading \"%s\": Failed to open file.\n", fn);
+			*errcd = -1;
+			return std::shared_ptr<const img>();
+		}
+		
+		std::unique_lock<std::mutex> l(lock);
+		
+		std::unordered_map<std::string, std::list<entry>::iterator>::iterator found = index.find(path);
+		if (found != index.end()) {
+			if (found->second->version == version) {
+				lru.splice(lru.begin(), lru, found->second);
+				counts.hits++;
+				return found->second->im;
+			}
+			
+			// The file has changed since it was decoded.
+			drop(found->second);
+		}
+		
+		// Wait for another thread which is already decoding this version of the file.
+		std::string key = path + '\0' + version;
+		std::unordered_map<std::string, std::shared_future<result> >::iterator pending = loading.find(key);
+		if (pending != loading.end()) {
+			std::shared_future<result> f = pending->second;
+			counts.hits++;
+			counts.waits++;
+			l.unlock();
+			
+			result r = f.get();
+			*errcd = r.errcd;
+			return r.im;
+		}
+		
+		counts.misses++;
+		pending_decode p(*this, l, key);
+		loading[key] = p.done.get_future().share();
+		l.unlock();
+		
+		img* im = new img();
+		if (img::load_png(fn, *im, opts, verbose, &p.r.errcd) != NULL) {
+			p.r.im = std::shared_ptr<const img>(im);
+		} else {
+			delete im;
+		}
+		
+		// Images larger than the whole budget are returned without being cached.
+		l.lock();
+		if (p.r.im) {
+			entry e;
+			e.path = path;
+			e.version = version;
+			e.im = p.r.im;
+			e.bytes = p.r.im->bsize + (p.r.im->palette != NULL ? p.r.im->palette_length * 3 : 0);
+			
+			// Another thread may have cached a different version of the file in the meantime. There is no telling which of the two is newer, so the one already cached is kept.
+			found = index.find(path);
+			if (found != index.end() && found->second->version == version) {
+				drop(found->second);
+				found = index.end();
+			}
+			
+			if (found == index.end() && e.bytes <= budget) {
+				lru.push_front(e);
+				index[path] = lru.begin();
+				counts.entries++;
+				counts.bytes += e.bytes;
+				evict();
+			}
+		}
+		
+		*errcd = p.r.errcd;
+		return p.r.im;
+	}
+	
+	cache::pending_decode::pending_decode(cache& c, std::unique_lock<std::mutex>& l, const std::string& key) : c(c), l(l), key(key) {
+		// Until the decode succeeds or fails, its result is an allocation failure, which is what waiting threads see if load() throws.
+		r.errcd = -6;
+	}
+	
+	cache::pending_decode::~pending_decode() {
+		if (!l.owns_lock()) l.lock();
+		c.loading.erase(key);
+		l.unlock();
+		
+		done.set_value(r);
+	}
+	
+	void cache::set_budget(size_t budget) {
+		std::lock_guard<std::mutex> l(lock);
+		this->budget = budget;
+		evict();
+	}
+	
+	void cache::clear() {
+		std::lock_guard<std::mutex> l(lock);
+		lru.clear();
+		index.clear();
+		counts.entries = 0;
+		counts.bytes = 0;
+	}
+	
+	cache_stats cache::stats() {
+		std::lock_guard<std::mutex> l(lock);
+		return counts;
+	}
+	
+	bool cache::file_version(char* fn, std::string& version) {
+		struct stat st;
+		if (stat(fn, &st) != 0) return false;
+		
+		char buf[64];
+		
+		if (!hash_keys) {
+			snprintf(buf, 64, "%lld:%lld.%09ld", (long long) st.st_size, (long long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec);
+			version = buf;
+			return true;
+		}
+		
+		// 64 bit FNV-1a
+		FILE* fp = fopen(fn, "rb");
+		if (fp == NULL) return false;
+		
+		unsigned char* block = (unsigned char*) malloc(IMG_CACHE_HASH_BLOCK);
+		unsigned long long hash = 0xCBF29CE484222325ULL;
+		size_t n;
+		
+		while ((n = fread(block, 1, IMG_CACHE_HASH_BLOCK, fp)) > 0) {
+			for (size_t i = 0; i < n; i++) {
+				hash = (hash ^ block[i]) * 0x100000001B3ULL;
+			}
+		}
+		
+		free(block);
+		fclose(fp);
+		
+		snprintf(buf, 64, "%lld#%016llx", (long long) st.st_size, hash);
+		version = buf;
+		return true;
+	}
+	
+	void cache::drop(std::list<entry>::iterator e) {
+		counts.entries--;
+		counts.bytes -= e->bytes;
+		index.erase(e->path);
+		lru.erase(e);
+	}
+	
+	void cache::evict() {
+		while (counts.bytes > budget && !lru.empty()) {
+			drop(--lru.end());
+			counts.evictions++;
+		}
+	}
+}
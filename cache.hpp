@@ -0,0 +1,114 @@
+#ifndef img_cache
+#define img_cache
+
+#include <sys/stat.h>
+
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "img.hpp"
+
+namespace img {
+	// Counters kept by img::cache. hits includes loads which waited for another thread to finish decoding the same file, those are also counted in waits.
+	class cache_stats {
+	public:
+		unsigned long long hits;
+		unsigned long long misses;
+		unsigned long long waits;
+		unsigned long long evictions;
+		
+		// Number of images held, and the memory used by their pixels and palettes.
+		size_t entries;
+		size_t bytes;
+	};
+	
+	// A thread-safe cache of decoded PNG images, which evicts the least recently used images once it holds more than its byte budget.
+	// Images are handed out as shared pointers, so readers never copy pixel data, and an evicted image lives on until its last reader lets go of it.
+	// If several threads miss on the same file at once, only one of them decodes it and the others wait for its result.
+	class cache {
+	public:
+		// opts are used for every image this cache loads, except for out_fn and out_map which are ignored.
+		cache(size_t budget, const png_opts& opts);
+		
+		// Identify versions of a file by a hash of its contents instead of its size and modification time. This reads the whole file on every load, which is still far cheaper than decoding it, and catches files which are rewritten within the resolution of their timestamps.
+		bool hash_keys;
+		
+		// Return the decoded image for fn, decoding it if it is not cached or the file has changed since it was.
+		// On failure returns an empty pointer and sets errcd as img::load_png() does. Failures are not cached.
+		std::shared_ptr<const img> load(char* fn, int verbose, int* errcd);
+		
+		// Change the byte budget, evicting images as needed.
+		void set_budget(size_t budget);
+		
+		// Drop every cached image. Images still in use stay valid.
+		void clear();
+		
+		cache_stats stats();
+		
+	private:
+		class entry {
+		public:
+			std::string path;
+			
+			// Size and modification time, or content hash, of the file the image was decoded from.
+			std::string version;
+			
+			std::shared_ptr<const img> im;
+			size_t bytes;
+		};
+		
+		// Result of a decode, shared with every thread waiting for it.
+		class result {
+		public:
+			std::shared_ptr<const img> im;
+			int errcd;
+		};
+		
+		// Ends a decode started by load(): removes it from loading and hands its result to the threads waiting for it.
+		// This also happens when load() leaves through an exception, in which case the waiting threads get errcd -6.
+		class pending_decode {
+		public:
+			pending_decode(cache& c, std::unique_lock<std::mutex>& l, const std::string& key);
+			
+			std::promise<result> done;
+			result r;
+			
+			~pending_decode();
+		private:
+			cache& c;
+			std::unique_lock<std::mutex>& l;
+			std::string key;
+		};
+		
+		png_opts opts;
+		
+		std::mutex lock;
+		
+		size_t budget;
+		cache_stats counts;
+		
+		// Most recently used images first, indexed by path.
+		std::list<entry> lru;
+		std::unordered_map<std::string, std::list<entry>::iterator> index;
+		
+		// Decodes in progress, indexed by path and version.
+		std::unordered_map<std::string, std::shared_future<result> > loading;
+		
+		// Describe the current version of fn. Returns false if the file cannot be read.
+		bool file_version(char* fn, std::string& version);
+		
+		// Remove an image from the cache. Must be called with lock held.
+		void drop(std::list<entry>::iterator e);
+		
+		// Evict least recently used images until the cache fits its budget. Must be called with lock held.
+		void evict();
+	};
+}
+
+#include "cache.cpp"
+
+#endif
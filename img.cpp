@@ -1,11 +1,637 @@
-#define IMG_IDAT_STREAM_SIZE 8192
+#define IMG_WRITE_BEHIND_SIZE 0x1000000
+#define IMG_CRC_SLICE 0x10000
 
 namespace img {
-	img::img() : palette(NULL), data(NULL) {}
+	// Origin and step of each Adam-7 pass, as x0, y0, dx, dy.
+	static const unsigned char adam7[7][4] = {{0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4}, {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}};
 	
-	img* img::load_png(char* fn, img& im, int verbose, int* errcd) {
-		*errcd = 0;
+	// Ceiling of a / b. Unlike (a + b - 1) / b, this cannot wrap around for large values of b, such as a huge png_opts::scale.
+	static inline unsigned int png_div_up(unsigned int a, unsigned int b) {
+		return a / b + (a % b != 0);
+	}
+	
+	/* png_opts */
+	
+	png_opts::png_opts() : scale(1), early_passes(false), max_width(0), max_height(0), crop_x(0), crop_y(0), crop_w(0), crop_h(0), out_fn(NULL), out_map(NULL), out_map_len(0), crc_mode(PNG_CRC_SERIAL), trust(PNG_TRUST_NONE) {}
+	
+	/* CRC */
+	
+	// Lookup tables for processing 8 bytes at a time. Row 0 is the usual byte-at-a-time table, row k gives the effect of a byte followed by k zero bytes.
+	class png_crc_tables {
+	public:
+		unsigned int t[8][256];
+		
+		png_crc_tables() {
+			unsigned int c;
+			for (int n = 0; n < 256; n++) {
+				c = (unsigned int) n;
+				for (int k = 0; k < 8; k++) {
+					if (c & 1) {
+						c = 0xEDB88320 ^ (c >> 1);
+					} else {
+						c = c >> 1;
+					}
+				}
+				t[0][n] = c;
+			}
+			for (int k = 1; k < 8; k++) {
+				for (int n = 0; n < 256; n++) {
+					t[k][n] = (t[k-1][n] >> 8) ^ t[0][t[k-1][n] & 0xFF];
+				}
+			}
+		}
+	};
+	
+	static const png_crc_tables png_crc_table;
+	
+	// Continue a CRC over n more bytes. crc is the running value, which starts out as 0xFFFFFFFF and is inverted once all the data has been added.
+	static unsigned int png_crc_update(unsigned int crc, const unsigned char* data, size_t n) {
+		const unsigned int (*t)[256] = png_crc_table.t;
+		
+		while (n >= 8) {
+			crc ^= data[0] | data[1] << 8 | data[2] << 16 | (unsigned int) data[3] << 24;
+			crc = t[7][crc & 0xFF] ^ t[6][(crc >> 8) & 0xFF] ^ t[5][(crc >> 16) & 0xFF] ^ t[4][crc >> 24] ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+			data += 8;
+			n -= 8;
+		}
+		while (n > 0) {
+			crc = t[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+			data++;
+			n--;
+		}
+		
+		return crc;
+	}
+	
+	/* png_crc_checker */
+	
+	png_crc_checker::png_crc_checker() : stop(false), bad(false) {
+		bad_type[4] = 0;
+		worker = std::thread(&png_crc_checker::run, this);
+	}
+	
+	void png_crc_checker::check(std::shared_ptr<unsigned char> buf, size_t n, unsigned int crc) {
+		job j;
+		j.buf = buf;
+		j.n = n;
+		j.crc = crc;
+		
+		std::lock_guard<std::mutex> l(lock);
+		jobs.push_back(j);
+		wake.notify_one();
+	}
+	
+	bool png_crc_checker::failed() {
+		return bad;
+	}
+	
+	bool png_crc_checker::finish(char* type) {
+		if (worker.joinable()) {
+			{
+				std::lock_guard<std::mutex> l(lock);
+				stop = true;
+				wake.notify_one();
+			}
+			worker.join();
+		}
+		
+		if (bad) {
+			memcpy(type, bad_type, 5);
+			return false;
+		}
+		return true;
+	}
+	
+	void png_crc_checker::run() {
+		std::unique_lock<std::mutex> l(lock);
+		job j;
+		bool ok;
+		
+		while (true) {
+			while (jobs.empty() && !stop) {
+				wake.wait(l);
+			}
+			if (jobs.empty()) return;
+			
+			j = jobs.front();
+			jobs.pop_front();
+			l.unlock();
+			
+			ok = (png_crc_update(0xFFFFFFFF, j.buf.get(), j.n) ^ 0xFFFFFFFF) == j.crc;
+			if (!ok && !bad) {
+				memcpy(bad_type, j.buf.get(), 4);
+				bad = true;
+			}
+			
+			// The chunk is freed here if load_png() is already done with it.
+			j.buf.reset();
+			l.lock();
+		}
+	}
+	
+	png_crc_checker::~png_crc_checker() {
+		char type[5];
+		finish(type);
+	}
+	
+	/* png_scanlines */
+	
+	png_scanlines::png_scanlines(unsigned int width, unsigned int height, unsigned char bits_pp, bool interlaced, png_row_sink* sink) : last_pass(7), sink(sink), max_x(width), max_y(height), interlaced(interlaced), pass(0), y(0), bits_pp(bits_pp), fill(0), skip(0) {
+		fbpp = bits_pp < 8 ? 1 : bits_pp / 8;
+		
+		if (interlaced) {
+			for (int p = 0; p < 7; p++) {
+				passes[p].x0 = adam7[p][0];
+				passes[p].y0 = adam7[p][1];
+				passes[p].dx = adam7[p][2];
+				passes[p].dy = adam7[p][3];
+				passes[p].width  = width  > passes[p].x0 ? (width  - passes[p].x0 + passes[p].dx - 1) / passes[p].dx : 0;
+				passes[p].height = height > passes[p].y0 ? (height - passes[p].y0 + passes[p].dy - 1) / passes[p].dy : 0;
+			}
+		} else {
+			passes[0].x0 = 0;
+			passes[0].y0 = 0;
+			passes[0].dx = 1;
+			passes[0].dy = 1;
+			passes[0].width = width;
+			passes[0].height = height;
+		}
+		
+		// No pass is wider than the image itself, so one full-width scanline (plus the filter-type byte) is enough for all of them.
+		cap = ((size_t) width * bits_pp + 7) / 8 + 1;
+		cur = (unsigned char*) malloc(cap);
+		prev = (unsigned char*) calloc(cap, 1);
+		
+		// Skip any leading empty passes.
+		if (cur != NULL && prev != NULL) {
+			advance();
+		}
+	}
+	
+	void png_scanlines::clip(unsigned int max_x, unsigned int max_y) {
+		this->max_x = max_x;
+		this->max_y = max_y;
+		advance();
+	}
+	
+	size_t png_scanlines::row_bytes(const png_pass& p) {
+		return ((size_t) p.width * bits_pp + 7) / 8;
+	}
+	
+	void png_scanlines::advance() {
+		unsigned char num_passes = interlaced ? 7 : 1;
+		
+		while (pass < num_passes) {
+			const png_pass& p = passes[pass];
+			
+			if (p.width > 0 && y < p.height) {
+				if (p.y0 + y * p.dy < max_y) return;
+				
+				// Everything left in this pass is below the clip rectangle.
+				skip += (p.height - y) * (row_bytes(p) + 1);
+			}
+			
+			pass++;
+			y = 0;
+			
+			// The first scanline of each pass is unfiltered as if it were preceded by a row of zeroes.
+			memset(prev, 0, cap);
+		}
+	}
+	
+	bool png_scanlines::done() {
+		return pass >= (interlaced ? last_pass : 1);
+	}
+	
+	bool png_scanlines::allocated() {
+		return cur != NULL && prev != NULL && sink->allocated();
+	}
+	
+	bool png_scanlines::push(const unsigned char* bytes, size_t n) {
+		size_t len;
+		size_t take;
+		unsigned char* temp;
+		
+		png_pass* p;
+		unsigned int used;
+		
+		while (n > 0 && !done()) {
+			if (skip > 0) {
+				take = skip < n ? skip : n;
+				skip -= take;
+				bytes += take;
+				n -= take;
+				continue;
+			}
+			
+			p = &passes[pass];
+			len = row_bytes(*p) + 1;
+			
+			take = len - fill;
+			if (take > n) take = n;
+			
+			memcpy(cur + fill, bytes, take);
+			fill += take;
+			bytes += take;
+			n -= take;
+			
+			// Wait for the rest of the scanline.
+			if (fill < len) break;
+			
+			// Only the pixels left of max_x need to be reconstructed.
+			used = p->width;
+			if (max_x <= p->x0) {
+				used = 0;
+			} else if ((max_x - p->x0 + p->dx - 1) / p->dx < used) {
+				used = (max_x - p->x0 + p->dx - 1) / p->dx;
+			}
+			
+			if (!unfilter(((size_t) used * bits_pp + 7) / 8)) return false;
+			
+			sink->row(*p, y, cur + 1);
+			
+			temp = prev; prev = cur; cur = temp;
+			fill = 0;
+			
+			y++;
+			advance();
+		}
+		
+		return true;
+	}
+	
+	bool png_scanlines::unfilter(size_t n) {
+		unsigned char* r = cur + 1;
+		unsigned char* p = prev + 1;
+		
+		size_t i;
+		int a, b, c, pa, pb, pc;
+		
+		switch (cur[0]) {
+			// None
+			case 0:
+				break;
+			// Sub
+			case 1:
+				for (i = fbpp; i < n; i++) {
+					r[i] += r[i - fbpp];
+				}
+				break;
+			// Up
+			case 2:
+				for (i = 0; i < n; i++) {
+					r[i] += p[i];
+				}
+				break;
+			// Average
+			case 3:
+				for (i = 0; i < fbpp && i < n; i++) {
+					r[i] += p[i] >> 1;
+				}
+				for (; i < n; i++) {
+					r[i] += (r[i - fbpp] + p[i]) >> 1;
+				}
+				break;
+			// Paeth
+			case 4:
+				for (i = 0; i < fbpp && i < n; i++) {
+					r[i] += p[i];
+				}
+				for (; i < n; i++) {
+					a = r[i - fbpp];
+					b = p[i];
+					c = p[i - fbpp];
+					
+					pa = abs(b - c);
+					pb = abs(a - c);
+					pc = abs(a + b - 2*c);
+					
+					if (pa <= pb && pa <= pc) {
+						r[i] += a;
+					} else if (pb <= pc) {
+						r[i] += b;
+					} else {
+						r[i] += c;
+					}
+				}
+				break;
+			default:
+				return false;
+		}
+		
+		return true;
+	}
+	
+	png_scanlines::~png_scanlines() {
+		free(cur);
+		free(prev);
+	}
+	
+	/* png_copy_sink */
+	
+	png_copy_sink::png_copy_sink(unsigned char* dst, size_t pitch, unsigned char bpp, unsigned int grid) : dst(dst), pitch(pitch), bpp(bpp), grid(grid), done(0) {}
+	
+	void png_copy_sink::row(const png_pass& pass, unsigned int y, const unsigned char* px) {
+		unsigned int iy = pass.y0 + y * pass.dy;
+		if (iy % grid != 0) return;
+		
+		unsigned char* out = dst + (size_t) (iy / grid) * pitch;
+		
+		// Full-width rows can be copied as they are. This is the only case for bit depths below 8.
+		if (pass.dx == 1 && grid == 1) {
+			memcpy(out, px, pitch);
+			if (pass.dy == 1) {
+				done = (size_t) (iy + 1) * pitch;
+			}
+			return;
+		}
+		
+		unsigned int ix;
+		for (unsigned int i = 0; i < pass.width; i++) {
+			ix = pass.x0 + i * pass.dx;
+			if (ix % grid != 0) continue;
+			
+			memcpy(out + (size_t) (ix / grid) * bpp, px + (size_t) i * bpp, bpp);
+		}
+	}
+	
+	size_t png_copy_sink::complete() {
+		return done;
+	}
+	
+	/* png_crop_sink */
+	
+	png_crop_sink::png_crop_sink(unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned char bits_pp, png_row_sink* next) : x(x), y(y), w(w), h(h), bits_pp(bits_pp), next(next) {
+		buf = (unsigned char*) malloc(((size_t) w * bits_pp + 7) / 8);
+	}
+	
+	void png_crop_sink::row(const png_pass& pass, unsigned int y, const unsigned char* px) {
+		unsigned int iy = pass.y0 + y * pass.dy;
+		if (iy < this->y || iy >= this->y + h) return;
+		
+		// First pixel and row of the pass inside the rectangle.
+		unsigned int i0 = x > pass.x0 ? (x - pass.x0 + pass.dx - 1) / pass.dx : 0;
+		unsigned int j0 = this->y > pass.y0 ? (this->y - pass.y0 + pass.dy - 1) / pass.dy : 0;
+		
+		unsigned int ix0 = pass.x0 + i0 * pass.dx;
+		unsigned int iy0 = pass.y0 + j0 * pass.dy;
+		if (ix0 >= x + w) return;
+		
+		png_pass cropped;
+		cropped.x0 = ix0 - x;
+		cropped.y0 = iy0 - this->y;
+		cropped.dx = pass.dx;
+		cropped.dy = pass.dy;
+		cropped.width  = (x + w - ix0 + pass.dx - 1) / pass.dx;
+		cropped.height = (this->y + h - iy0 + pass.dy - 1) / pass.dy;
+		
+		if (bits_pp >= 8) {
+			memcpy(buf, px + (size_t) i0 * (bits_pp / 8), (size_t) cropped.width * (bits_pp / 8));
+		} else {
+			// Packed pixels have to be shifted to start on a byte boundary. Only non-interlaced images get here, so i0 is simply x.
+			size_t bit;
+			unsigned char mask = (1 << bits_pp) - 1;
+			unsigned char v;
+			
+			memset(buf, 0, ((size_t) w * bits_pp + 7) / 8);
+			for (unsigned int i = 0; i < w; i++) {
+				bit = (size_t) (x + i) * bits_pp;
+				v = (px[bit / 8] >> (8 - bits_pp - bit % 8)) & mask;
+				
+				bit = (size_t) i * bits_pp;
+				buf[bit / 8] |= v << (8 - bits_pp - bit % 8);
+			}
+		}
+		
+		next->row(cropped, (iy - iy0) / pass.dy, buf);
+	}
+	
+	bool png_crop_sink::allocated() {
+		return buf != NULL && next->allocated();
+	}
+	
+	png_crop_sink::~png_crop_sink() {
+		free(buf);
+	}
+	
+	/* png_box_sink */
+	
+	png_box_sink::png_box_sink(unsigned int width, unsigned int height, unsigned int scale, unsigned char channels, unsigned char bit_depth, unsigned char* dst, size_t pitch) : width(width), height(height), scale(scale), channels(channels), bit_depth(bit_depth), dst(dst), pitch(pitch), acc_rows(0), src_y(0), dst_y(0) {
+		acc = (unsigned long long*) calloc((size_t) png_div_up(width, scale) * channels, sizeof(unsigned long long));
+	}
+	
+	void png_box_sink::row(const png_pass&, unsigned int, const unsigned char* px) {
+		add_row(px);
+	}
+	
+	void png_box_sink::add_row(const unsigned char* px) {
+		if (src_y >= height) return;
+		
+		unsigned long long* a = acc;
+		size_t end;
+		size_t x;
+		int c;
+		
+		for (size_t bx = 0; bx < width; bx += scale) {
+			end = bx + scale < width ? bx + scale : width;
+			
+			if (bit_depth == 16) {
+				for (x = bx; x < end; x++) {
+					for (c = 0; c < channels; c++) {
+						a[c] += px[2*(x*channels + c)] << 8 | px[2*(x*channels + c) + 1];
+					}
+				}
+			} else {
+				for (x = bx; x < end; x++) {
+					for (c = 0; c < channels; c++) {
+						a[c] += px[x*channels + c];
+					}
+				}
+			}
+			
+			a += channels;
+		}
+		
+		acc_rows++;
+		src_y++;
+		
+		if (acc_rows == scale || src_y == height) {
+			flush();
+		}
+	}
+	
+	// Write out the averages of the current row of blocks and clear the running sums.
+	void png_box_sink::flush() {
+		unsigned char* out = dst + (size_t) dst_y * pitch;
+		size_t ow = png_div_up(width, scale);
+		
+		unsigned long long n;
+		unsigned long long v;
+		
+		for (size_t ox = 0; ox < ow; ox++) {
+			n = (unsigned long long) (width - ox*scale < scale ? width - ox*scale : scale) * acc_rows;
+			
+			for (int c = 0; c < channels; c++) {
+				v = (acc[ox*channels + c] + n/2) / n;
+				
+				if (bit_depth == 16) {
+					out[2*(ox*channels + c)] = v >> 8;
+					out[2*(ox*channels + c) + 1] = v & 0xFF;
+				} else {
+					out[ox*channels + c] = v;
+				}
+			}
+		}
+		
+		memset(acc, 0, (size_t) ow * channels * sizeof(unsigned long long));
+		acc_rows = 0;
+		dst_y++;
+	}
+	
+	size_t png_box_sink::complete() {
+		return (size_t) dst_y * pitch;
+	}
+	
+	bool png_box_sink::allocated() {
+		return acc != NULL;
+	}
+	
+	png_box_sink::~png_box_sink() {
+		free(acc);
+	}
+	
+	/* png_sum_sink */
+	
+	png_sum_sink::png_sum_sink(unsigned int width, unsigned int height, unsigned int scale, unsigned int grid, unsigned char channels, unsigned char bit_depth, unsigned char* dst, size_t pitch) : width(width), height(height), scale(scale), grid(grid), channels(channels), bit_depth(bit_depth), dst(dst), pitch(pitch) {
+		out_width = png_div_up(width, scale);
+		out_height = png_div_up(height, scale);
+		
+		unsigned long long points = (unsigned long long) (scale / grid) * (scale / grid);
+		wide = points > 0xFFFFFFFFULL / (bit_depth == 16 ? 0xFFFF : 0xFF);
+		acc = calloc((size_t) out_width * out_height * channels, wide ? sizeof(unsigned long long) : sizeof(unsigned int));
+	}
+	
+	void png_sum_sink::row(const png_pass& pass, unsigned int y, const unsigned char* px) {
+		unsigned int iy = pass.y0 + y * pass.dy;
+		if (iy % grid != 0 || iy >= height) return;
 		
+		if (wide) {
+			add((unsigned long long*) acc, pass, iy, px);
+		} else {
+			add((unsigned int*) acc, pass, iy, px);
+		}
+	}
+	
+	template <class T> void png_sum_sink::add(T* sums, const png_pass& pass, unsigned int iy, const unsigned char* px) {
+		T* a = sums + (size_t) (iy / scale) * out_width * channels;
+		T* b;
+		unsigned int ix;
+		int c;
+		
+		for (unsigned int i = 0; i < pass.width; i++) {
+			ix = pass.x0 + i * pass.dx;
+			if (ix % grid != 0) continue;
+			
+			b = a + (size_t) (ix / scale) * channels;
+			if (bit_depth == 16) {
+				for (c = 0; c < channels; c++) {
+					b[c] += px[2*((size_t) i*channels + c)] << 8 | px[2*((size_t) i*channels + c) + 1];
+				}
+			} else {
+				for (c = 0; c < channels; c++) {
+					b[c] += px[(size_t) i*channels + c];
+				}
+			}
+		}
+	}
+	
+	bool png_sum_sink::allocated() {
+		return acc != NULL;
+	}
+	
+	void png_sum_sink::finish() {
+		if (wide) {
+			average((const unsigned long long*) acc);
+		} else {
+			average((const unsigned int*) acc);
+		}
+	}
+	
+	template <class T> void png_sum_sink::average(const T* sums) {
+		const T* a = sums;
+		unsigned char* out;
+		unsigned long long n;
+		unsigned long long v;
+		unsigned int bw;
+		unsigned int bh;
+		
+		for (unsigned int oy = 0; oy < out_height; oy++) {
+			out = dst + (size_t) oy * pitch;
+			bh = height - oy*scale < scale ? height - oy*scale : scale;
+			
+			for (unsigned int ox = 0; ox < out_width; ox++) {
+				// Blocks start on the grid, so a block of bw x bh pixels contains this many grid points.
+				bw = width - ox*scale < scale ? width - ox*scale : scale;
+				n = (unsigned long long) ((bw + grid - 1) / grid) * ((bh + grid - 1) / grid);
+				
+				for (int c = 0; c < channels; c++) {
+					v = (a[c] + n/2) / n;
+					
+					if (bit_depth == 16) {
+						out[2*((size_t) ox*channels + c)] = v >> 8;
+						out[2*((size_t) ox*channels + c) + 1] = v & 0xFF;
+					} else {
+						out[(size_t) ox*channels + c] = v;
+					}
+				}
+				a += channels;
+			}
+		}
+	}
+	
+	png_sum_sink::~png_sum_sink() {
+		free(acc);
+	}
+	
+	/* Inflated data */
+	
+	// The inflater writes to a stream made with fopencookie(), which hands its data straight to the scanline decoder. Only the inflater's window is held at any time, however large the IDAT chunks are.
+	class png_inflated {
+	public:
+		png_scanlines* lines;
+		// Cleared once a scanline with an invalid filter type is found, after which the rest of the data is dropped.
+		bool unfiltered;
+		
+		png_inflated() : lines(NULL), unfiltered(true) {}
+	};
+	
+	static ssize_t png_inflated_write(void* cookie, const char* d, size_t n) {
+		png_inflated* o = (png_inflated*) cookie;
+		if (o->lines != NULL && o->unfiltered) {
+			o->unfiltered = o->lines->push((const unsigned char*) d, n);
+		}
+		return n;
+	}
+	
+	/* img */
+	
+	img::img() : palette(NULL), trns_length(0), trns(NULL), data(NULL), data_mode(0) {}
+	
+	img* img::load_png(char* fn, img& im, int verbose, int* errcd) {
+		png_opts opts;
+		return load_png(fn, im, opts, verbose, errcd);
+	}
+	
+	img* img::load_png(char* fn, img& im, unsigned int x, unsigned int y, unsigned int w, unsigned int h, int verbose, int* errcd) {
+		png_opts opts;
+		opts.crop_x = x;
+		opts.crop_y = y;
+		opts.crop_w = w;
+		opts.crop_h = h;
+		return load_png(fn, im, opts, verbose, errcd);
+	}
+	
+	img* img::load_png(char* fn, img& im, const png_opts& opts, int verbose, int* errcd) {
 		// Open png file
 		FILE* fp = fopen(fn, "rb");
 		if (fp == NULL) {
@@ -13,26 +639,39 @@ namespace img {
 			*errcd = -1; return NULL;
 		}
 		
+		img* ret = load_png(fp, fn, im, opts, verbose, errcd);
+		fclose(fp);
+		return ret;
+	}
+	
+	img* img::load_png(FILE* fp, char* fn, img& im, const png_opts& opts, int verbose, int* errcd) {
+		*errcd = 0;
+		
 		// 4 bytes for lenght, 4 bytes for type, null terminating byte, 4 bytes for CRC
 		unsigned char* chnk_meta = (unsigned char*) malloc(13);
 		unsigned char* chnk_data;
 		
-		// Test for signature
+		// Test for signature. The buffer is cleared first so that files shorter than a signature fail the test too.
+		memset(chnk_meta, 0, 8);
 		fread(chnk_meta, 1, 8, fp);
 		if (chnk_meta[0] != 0x89 || chnk_meta[1] != 0x50 || chnk_meta[2] != 0x4E || chnk_meta[3] != 0x47) {
 			if (verbose >= 3) printf("Error While Loading \"%s\": File does not appear to be a PNG file.\n", fn);
+			free(chnk_meta);
 			*errcd = -2; return NULL;
 		}
 		if (chnk_meta[4] != 0x0D || chnk_meta[5] != 0x0A) {
 			if (verbose >= 3) printf("Error While Loading \"%s\": This PNG file has likely been corrupted while being transmitted onto a Unix system.\n", fn);
+			free(chnk_meta);
 			*errcd = -3; return NULL;
 		}
 		if (chnk_meta[6] != 0x1A) {
 			if (verbose >= 3) printf("Error While Loading \"%s\": This PNG file appears to be corrupted.\n", fn);
+			free(chnk_meta);
 			*errcd = -3; return NULL;
 		}
 		if (chnk_meta[7] != 0x0A) {
 			if (verbose >= 3) printf("Error While Loading \"%s\": This PNG file has likely been corrupted while being transmitted onto a Windows/DOS system.\n", fn);
+			free(chnk_meta);
 			*errcd = -3; return NULL;
 		}
 		
@@ -52,23 +691,67 @@ namespace img {
 		// Detect CPU endianness
 //		int t = 1;
 //		bool isBE = *((char*) &t) == 0;
-		
+
 		unsigned char temp;
 		
 		bool found_IHDR = false;
 		bool found_PLTE = false;
+		bool found_tRNS = false;
 		bool critical;
 		unsigned char interlacing;
 		
-		unsigned int idat_start;
+		// Whether the CRC of the current chunk is checked, and whether that happens while it is inflated rather than before.
+		bool verify;
+		bool deferred;
+		bool sliced;
+		png_crc_checker* checker = NULL;
+		char bad_type[5];
+		
+		// Position in the current IDAT chunk, and the number of its bytes covered by the sliced CRC so far.
+		size_t off;
+		size_t n;
+		size_t checked;
+		unsigned int running;
 		
 		bool ret;
+		bool unfiltered;
+		
+		// Geometry of the image as stored in the file. im.width and im.height are those of the decoded (possibly downscaled) image.
+		unsigned int src_width;
+		unsigned int src_height;
+		unsigned char channels;
+		unsigned char bits_pp;
+		unsigned int scale;
+		
+		// Adam-7 images which are decoded at reduced size are summed up by sums, see below.
+		unsigned int grid;
+		png_sum_sink* sums = NULL;
+		
+		// Region of the source image being decoded.
+		unsigned int rgn_x;
+		unsigned int rgn_y;
+		unsigned int rgn_w;
+		unsigned int rgn_h;
 		
-		// Holds Decompressed data, before it gets filtered and sent to im.data
-		unsigned char* buf = (unsigned char*) malloc(IMG_IDAT_STREAM_SIZE);
+		png_scanlines* lines = NULL;
+		png_row_sink* sink = NULL;
+		png_crop_sink* crop = NULL;
 		
-		// Create a zlib_stream for decompressing image data.
-		util::zlib_stream idat(fp, fmemopen(buf, IMG_IDAT_STREAM_SIZE, (const char*) "w"));
+		// Output file descriptor when decoding to png_opts::out_fn, and how much of im.data has been written back so far.
+		int out_fd = -1;
+		size_t flushed = 0;
+		
+		// Decompressed data goes straight to the scanline decoder, which filters it and sends it to im.data. The stream is unbuffered, the inflater already writes whole runs of its window.
+		png_inflated inflated;
+		cookie_io_functions_t inflated_io = {NULL, png_inflated_write, NULL, NULL};
+		FILE* idat_out = fopencookie(&inflated, "w", inflated_io);
+		if (idat_out != NULL) {
+			setvbuf(idat_out, NULL, _IONBF, 0);
+		}
+		
+		// Create a zlib_stream for decompressing image data. Its input is switched to each IDAT chunk in turn, which has already been read into memory.
+		util::zlib_stream idat(NULL, idat_out);
+		FILE* idat_in;
 		
 		while (true) {
 			// Read length and chunk type
@@ -86,8 +769,6 @@ namespace img {
 			data[*len] = 0;
 			chnk_data[0] = type[0]; chnk_data[1] = type[1]; chnk_data[2] = type[2]; chnk_data[3] = type[3];
 			
-			idat_start = ftell(fp);
-			
 			// Read chunk data content
 			if (*len > 0) fread(data, 1, *len, fp);
 			
@@ -99,11 +780,11 @@ namespace img {
 			
 			// Convert endianness of the CRC
 			swap(chnk_meta+9);
-			
+
 //			printf("Found chunk \"%s\"\n", type);
-			
+
 			if (type[0] == 'I' && type[1] == 'E' && type[2] == 'N' && type[3] == 'D') {
-				printf("IEND chunk found, exiting.\n");
+				if (verbose >= 4) printf("IEND chunk found, exiting.\n");
 				free(chnk_data);
 				break;
 			}
@@ -111,18 +792,25 @@ namespace img {
 			if (read_ret == 0) {
 				if (verbose >= 3) printf("Error While Loading \"%s\": Encountered End Of File before finding an IEND chunk.\n", fn);
 				*errcd = -3;
+				free(chnk_data);
 				break;
 			}
 			
+			// Trusted input skips some or all CRCs. In the pipelined modes, IDAT chunks are checked while they are inflated instead of here.
+			verify = opts.trust == PNG_TRUST_NONE || (opts.trust == PNG_TRUST_ANCILLARY && critical);
+			deferred = verify && opts.crc_mode != PNG_CRC_SERIAL && type[0] == 'I' && type[1] == 'D' && type[2] == 'A' && type[3] == 'T';
+			
 			// Calculate and check the CRC
-			c_crc = png_crc(chnk_data, *len+4);
+			c_crc = verify && !deferred ? png_crc(chnk_data, *len+4) : *crc;
 			if (*crc != c_crc) {
 				if (critical) {
 					if (verbose >= 3) printf("Error While Loading \"%s\": CRC Check failed on critical chunk \"%s\".\n", fn, type);
 					*errcd = -5;
-					return NULL;
+					free(chnk_data);
+					break;
 				} else {
 					if (verbose >= 2) printf("Warning While Loading \"%s\": CRC Check failed on ancillary chunk \"%s\". Skipping chunk.\n", fn, type);
+					free(chnk_data);
 					continue;
 				}
 			}
@@ -135,93 +823,338 @@ namespace img {
 				if (*((unsigned int*) type) == IHDR) {
 					found_IHDR = true;
 					
+					if (*len != 13) {
+						if (verbose >= 3) printf("Error While Loading \"%s\": PNG IHDR chunk is of an invalid length.\n", fn);
+						*errcd = -5;
+						free(chnk_data);
+						break;
+					}
+					
 					swap(data);
 					swap(data+4);
 					
-					im.width = *((unsigned int*) data);
-					im.height = *((unsigned int*) (data+4));
+					src_width = *((unsigned int*) data);
+					src_height = *((unsigned int*) (data+4));
 					
 					im.bit_depth = data[8];
 					
+					channels = 0;
 					switch (data[9]) {
 						case 0:
 							im.is_RGB = false;
 							im.uses_palette = false;
 							im.alpha_mode = 0;
+							channels = 1;
 							break;
 						case 2:
 							im.is_RGB = true;
 							im.uses_palette = false;
 							im.alpha_mode = 0;
+							channels = 3;
 							break;
 						case 3:
 							im.is_RGB = true;
 							im.uses_palette = true;
 							im.alpha_mode = 0;
+							channels = 1;
 							break;
 						case 4:
 							im.is_RGB = false;
 							im.uses_palette = false;
 							im.alpha_mode = 1;
+							channels = 2;
 							break;
 						case 6:
 							im.is_RGB = true;
 							im.uses_palette = false;
 							im.alpha_mode = 1;
+							channels = 4;
+					}
+					
+					if (channels == 0 || (im.bit_depth != 1 && im.bit_depth != 2 && im.bit_depth != 4 && im.bit_depth != 8 && im.bit_depth != 16)) {
+						if (verbose >= 3) printf("Error While Loading \"%s\": PNG Header specifies an unrecognized color type or bit depth.\n", fn);
+						*errcd = -4;
+						free(chnk_data);
+						break;
 					}
 					
 					if (data[10] != 0) {
 						if (verbose >= 3) printf("Error While Loading \"%s\": PNG Header requests the use of an unsupported compression method.\n", fn);
 						*errcd = -4;
-						return NULL;
+						free(chnk_data);
+						break;
 					}
 					
 					if (data[11] != 0) {
 						if (verbose >= 3) printf("Error While Loading \"%s\": PNG Header requests the use of an unsupported filtering method.\n", fn);
 						*errcd = -4;
-						return NULL;
+						free(chnk_data);
+						break;
 					}
 					
 					interlacing = data[12];
 					if (interlacing > 1) {
 						if (verbose >= 3) printf("Error While Loading \"%s\": PNG Header requests the use of an unsupported interlacing method.\n", fn);
 						*errcd = -4;
-						return NULL;
+						free(chnk_data);
+						break;
 					}
-					else if (interlacing == 1) {
-						if (verbose >= 3) printf("Error While Loading \"%s\": PNG Header requests the use of an unsupported interlacing method Adam-7.\n", fn);
+					else if (interlacing == 1 && im.bit_depth < 8) {
+						if (verbose >= 3) printf("Error While Loading \"%s\": Adam-7 interlacing is only supported for bit depths of 8 and 16.\n", fn);
 						*errcd = -4;
-						return NULL;
+						free(chnk_data);
+						break;
 					}
 					
-					// Allocate space for output stream.
-					if (im.is_RGB) {
-						im.bpp = 3;
+					// The PNG specification limits both dimensions to 2^31-1, and an image without pixels has no scanlines to decode.
+					if (src_width == 0 || src_height == 0 || src_width > 0x7FFFFFFF || src_height > 0x7FFFFFFF) {
+						if (verbose >= 3) printf("Error While Loading \"%s\": PNG Header specifies an invalid image size of %ux%u.\n", fn, src_width, src_height);
+						*errcd = -4;
+						free(chnk_data);
+						break;
+					}
+					
+					// Pick the region to decode.
+					if (opts.crop_w > 0 && opts.crop_h > 0) {
+						if (opts.crop_x >= src_width || opts.crop_y >= src_height || opts.crop_w > src_width - opts.crop_x || opts.crop_h > src_height - opts.crop_y) {
+							if (verbose >= 3) printf("Error While Loading \"%s\": Requested region does not lie inside the %ux%u image.\n", fn, src_width, src_height);
+							*errcd = -4;
+							free(chnk_data);
+							break;
+						}
+						
+						rgn_x = opts.crop_x;
+						rgn_y = opts.crop_y;
+						rgn_w = opts.crop_w;
+						rgn_h = opts.crop_h;
 					} else {
+						rgn_x = 0;
+						rgn_y = 0;
+						rgn_w = src_width;
+						rgn_h = src_height;
+					}
+					
+					// Pick the downscale factor.
+					scale = opts.scale > 0 ? opts.scale : 1;
+					if (opts.max_width > 0 && png_div_up(rgn_w, opts.max_width) > scale) {
+						scale = png_div_up(rgn_w, opts.max_width);
+					}
+					if (opts.max_height > 0 && png_div_up(rgn_h, opts.max_height) > scale) {
+						scale = png_div_up(rgn_h, opts.max_height);
+					}
+					
+					if (scale > 1 && (im.uses_palette || im.bit_depth < 8)) {
+						if (verbose >= 3) printf("Error While Loading \"%s\": Downscaled decoding is only supported for non-palette images with bit depths of 8 and 16.\n", fn);
+						*errcd = -4;
+						free(chnk_data);
+						break;
+					}
+					
+					// Allocate space for output stream.
+					bits_pp = channels * im.bit_depth;
+					if (bits_pp < 8) {
 						im.bpp = 1;
+					} else {
+						im.bpp = bits_pp / 8;
 					}
-					if (im.alpha_mode) {
-						im.bpp++;
+					
+					im.width = png_div_up(rgn_w, scale);
+					im.height = png_div_up(rgn_h, scale);
+					
+					// PNG dimensions go up to 2^31-1, so the size of the image has to be checked before it is computed.
+					if (im.width > (SIZE_MAX - 7) / bits_pp || ((size_t) im.width * bits_pp + 7) / 8 > SIZE_MAX / im.height) {
+						if (verbose >= 3) printf("Error While Loading \"%s\": Image is too large to be addressed on this system.\n", fn);
+						*errcd = -4;
+						free(chnk_data);
+						break;
 					}
 					
-					im.pitch = im.bpp*im.width;
+					im.pitch = ((size_t) im.width * bits_pp + 7) / 8;
 					im.bsize = im.pitch*im.height;
-					im.data = (unsigned char*) malloc(im.bsize);
+					
+					if (opts.out_map != NULL) {
+						if (opts.out_map_len < im.bsize) {
+							if (verbose >= 3) printf("Error While Loading \"%s\": Output mapping is %zu bytes, but the image needs %zu.\n", fn, opts.out_map_len, im.bsize);
+							*errcd = -4;
+							free(chnk_data);
+							break;
+						}
+						
+						im.data = opts.out_map;
+						im.data_mode = 2;
+					}
+					else if (opts.out_fn != NULL) {
+						out_fd = open(opts.out_fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+						if (out_fd < 0) {
+							if (verbose >= 3) printf("Error While Loading \"%s\": Failed to open output file \"%s\".\n", fn, opts.out_fn);
+							*errcd = -1;
+							free(chnk_data);
+							break;
+						}
+						
+						// The file is extended without writing anything, so it stays sparse until the rows arrive.
+						void* map = MAP_FAILED;
+						if (ftruncate(out_fd, im.bsize) == 0) {
+							map = mmap(NULL, im.bsize, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+						}
+						if (map == MAP_FAILED) {
+							if (verbose >= 3) printf("Error While Loading \"%s\": Failed to map %zu bytes of output file \"%s\".\n", fn, im.bsize, opts.out_fn);
+							*errcd = -6;
+							free(chnk_data);
+							break;
+						}
+						
+						im.data = (unsigned char*) map;
+						im.data_mode = 1;
+						madvise(im.data, im.bsize, MADV_SEQUENTIAL);
+					}
+					else {
+						im.data = (unsigned char*) malloc(im.bsize);
+						im.data_mode = 0;
+						
+						if (im.data == NULL) {
+							if (verbose >= 3) printf("Error While Loading \"%s\": Failed to allocate %zu bytes for the image.\n", fn, im.bsize);
+							*errcd = -6;
+							free(chnk_data);
+							break;
+						}
+					}
+					
+					// Non-interlaced images are averaged one scanline at a time as they are decoded.
+					// The rows of an Adam-7 image arrive out of order, so they are summed into one running sum per output sample, which are averaged once the image is complete.
+					// With png_opts::early_passes, only pixels on a grid whose step is the largest of 8, 4 and 2 that divides the scale are summed. Every pixel on such a grid is complete after pass 1, 3 or 5 respectively, so the remaining passes need not be decoded at all.
+					// This only holds if the region starts on the grid as well.
+					grid = 1;
+					if (interlacing == 1 && opts.early_passes) {
+						for (unsigned int g = 8; g > 1; g /= 2) {
+							if (scale % g == 0 && rgn_x % g == 0 && rgn_y % g == 0) {
+								grid = g;
+								break;
+							}
+						}
+					}
+					
+					if (grid == scale) {
+						sink = new png_copy_sink(im.data, im.pitch, im.bpp, grid);
+					}
+					else if (interlacing == 0) {
+						sink = new png_box_sink(rgn_w, rgn_h, scale, channels, im.bit_depth, im.data, im.pitch);
+					}
+					else {
+						sums = new png_sum_sink(rgn_w, rgn_h, scale, grid, channels, im.bit_depth, im.data, im.pitch);
+						sink = sums;
+					}
+					
+					// The region is cut out of each scanline before it reaches the sink. Nothing right of or below it is unfiltered, and nothing below it is inflated.
+					if (rgn_w != src_width || rgn_h != src_height) {
+						crop = new png_crop_sink(rgn_x, rgn_y, rgn_w, rgn_h, bits_pp, sink);
+						lines = new png_scanlines(src_width, src_height, bits_pp, interlacing == 1, crop);
+					} else {
+						lines = new png_scanlines(src_width, src_height, bits_pp, interlacing == 1, sink);
+					}
+					
+					// A scanline of a very wide image, or the sums of a large downscaled one, may not fit in memory even if the output does.
+					if (!lines->allocated()) {
+						if (verbose >= 3) printf("Error While Loading \"%s\": Failed to allocate memory for decoding.\n", fn);
+						*errcd = -6;
+						free(chnk_data);
+						break;
+					}
+					
+					if (crop != NULL) {
+						lines->clip(rgn_x + rgn_w, rgn_y + rgn_h);
+					}
+					
+					if (grid == 8) {
+						lines->last_pass = 1;
+					} else if (grid == 4) {
+						lines->last_pass = 3;
+					} else if (grid == 2) {
+						lines->last_pass = 5;
+					}
+					inflated.lines = lines;
 					
 				} else {
 					if (verbose >= 3) printf("Error While Loading \"%s\": File is missing an IHDR chunk.\n", fn);
 					*errcd = -5;
-					return NULL;
+					free(chnk_data);
+					break;
 				}
 			}
-				
+			
 			if (*((unsigned int*) type) == IDAT) {
-				fseek(fp, idat_start, SEEK_SET);
-				ret = idat.inflate(*len);
+				// Keeps the chunk alive until both this loop and the checker thread are done with it.
+				std::shared_ptr<unsigned char> hold;
+				if (deferred && opts.crc_mode == PNG_CRC_THREAD) {
+					if (checker == NULL) {
+						checker = new png_crc_checker();
+					}
+					hold = std::shared_ptr<unsigned char>(chnk_data, free);
+					chnk_data = NULL;
+					checker->check(hold, *len + 4, *crc);
+				}
+				
+				idat_in = *len > 0 ? fmemopen(data, *len, "rb") : NULL;
+				idat.set_in(idat_in);
+				
+				// The chunk is inflated in slices of IMG_CRC_SLICE bytes, whatever its size, so that decoding stops soon after the last requested row. In PNG_CRC_SLICED mode, each slice is inflated right after its CRC has been taken.
+				sliced = deferred && opts.crc_mode == PNG_CRC_SLICED;
+				running = png_crc_update(0xFFFFFFFF, data - 4, 4);
+				checked = 0;
+				
+				ret = true;
+				for (off = 0; off < *len; off += n) {
+					n = *len - off < IMG_CRC_SLICE ? *len - off : IMG_CRC_SLICE;
+					
+					if (sliced) {
+						running = png_crc_update(running, data + off, n);
+						checked = off + n;
+					}
+					
+					ret = idat.inflate(n);
+					if (!ret || !inflated.unfiltered || lines->done()) break;
+				}
+				unfiltered = inflated.unfiltered;
+				
+				if (idat_in != NULL) {
+					fclose(idat_in);
+				}
+				
+				// The rest of the chunk still has to be checked if decoding stopped early. Corrupted data is the likely cause of any error found while inflating.
+				if (sliced) {
+					running = png_crc_update(running, data + checked, *len - checked);
+					if (*crc != (running ^ 0xFFFFFFFF)) {
+						if (verbose >= 3) printf("Error While Loading \"%s\": CRC Check failed on critical chunk \"IDAT\".\n", fn);
+						*errcd = -5;
+						free(chnk_data);
+						break;
+					}
+				}
+				
 				if (!ret) {
 					if (verbose >= 3) printf("Error While Loading \"%s\": Invalid zlib stream.\n", fn);
 					*errcd = -5;
-					return NULL;
+					free(chnk_data);
+					break;
+				}
+				
+				if (!unfiltered) {
+					if (verbose >= 3) printf("Error While Loading \"%s\": Encountered a scanline with an invalid filter type.\n", fn);
+					*errcd = -5;
+					free(chnk_data);
+					break;
+				}
+				
+				// Rows which are already final are written out while the rest of the image is still being decoded. Downscaled Adam-7 images are only written to im.data at the end.
+				if (im.data_mode != 0 && sums == NULL) {
+					write_behind(im, out_fd, &flushed, sink->complete());
+				}
+				
+				// Stop reading as soon as every requested scanline has been decoded. For Adam-7 thumbnails this skips the later passes entirely, and for regions everything below the last row.
+				// A chunk which has failed its check on the helper thread ends decoding as well, it is reported below.
+				if (lines->done() || (checker != NULL && checker->failed())) {
+					free(chnk_data);
+					break;
 				}
 			}
 			else if (*((unsigned int*) type) == PLTE) {
@@ -230,7 +1163,8 @@ namespace img {
 				if (*len % 3 != 0) {
 					if (verbose >= 3) printf("Error While Loading \"%s\": PNG PLTE chunk is of an invalid length.\n", fn);
 					*errcd = -5;
-					return NULL;
+					free(chnk_data);
+					break;
 				}
 				
 				im.palette_length = *len / 3;
@@ -239,6 +1173,19 @@ namespace img {
 					im.palette[i] = data[i];
 				}
 			}
+			else if (*((unsigned int*) type) == tRNS) {
+				// Palette images get one alpha value per entry, gray and RGB images one sample value which is transparent. Images with an alpha channel cannot have a tRNS chunk.
+				if (found_IHDR && !found_tRNS && (im.uses_palette ? *len <= 256 : im.alpha_mode == 0 && *len == (im.is_RGB ? 6u : 2u))) {
+					found_tRNS = true;
+					im.alpha_mode = im.uses_palette ? 2 : 3;
+					im.trns_length = *len;
+					im.trns = (unsigned char*) malloc(*len > 0 ? *len : 1);
+					memcpy(im.trns, data, *len);
+				}
+				else if (verbose >= 2) {
+					printf("Warning While Loading \"%s\": Ignoring tRNS chunk which does not match the color type.\n", fn);
+				}
+			}
 			else if (*((unsigned int*) type) == tEXt) {
 				char* txtdata;
 				for (txtdata = (char*) data; *txtdata != '\0'; txtdata++); txtdata++;
@@ -248,49 +1195,93 @@ namespace img {
 			free(chnk_data);
 		}
 		
-		fclose(fp);
+		// Wait for the chunks still being checked on the helper thread. As above, corruption takes precedence over any error it may have caused.
+		if (checker != NULL) {
+			if (!checker->finish(bad_type)) {
+				if (verbose >= 3) printf("Error While Loading \"%s\": CRC Check failed on critical chunk \"%s\".\n", fn, bad_type);
+				*errcd = -5;
+			}
+			delete checker;
+		}
+		
+		if (*errcd == 0 && (lines == NULL || !lines->done())) {
+			if (verbose >= 3) printf("Error While Loading \"%s\": Image data ended before the last scanline was decoded.\n", fn);
+			*errcd = -3;
+		}
+		
+		// Average the sums of a downscaled Adam-7 image.
+		if (*errcd == 0 && sums != NULL) {
+			sums->finish();
+		}
+		
+		if (*errcd == 0 && im.data_mode != 0) {
+			write_behind(im, out_fd, &flushed, im.bsize);
+		}
+		
+		// The mapping keeps the file open.
+		if (out_fd >= 0) {
+			close(out_fd);
+		}
+		
 		idat.close_out();
 		free(chnk_meta);
-		free(buf);
 		
-		return NULL;
+		delete lines;
+		delete crop;
+		delete sink;
+		
+		if (*errcd != 0) {
+			return NULL;
+		}
+		
+		return &im;
 	}
 	
 	img::~img() {
 		if (palette != NULL) {
 			free(palette);
 		}
+		free(trns);
 		if (data != NULL) {
-			free(data);
+			if (data_mode == 0) {
+				free(data);
+			}
+			else if (data_mode == 1) {
+				munmap(data, bsize);
+			}
 		}
 	}
 	
-	// I can't say I really understand this function fully. But I do know that it gave me too much grief to be worth looking into further.
-	// Turns out the bit shift operator is undefined for negative integers, so crc has to be unsigned. Who could've guessed? Also, remember to use "%08x" for hexadecimal, not just "%x"
-	int img::png_crc(unsigned char* data, int datan) {
-		// Build CRC table
-		unsigned int* crc_table = (unsigned int*) malloc(256 * sizeof(unsigned int));
-		for (int n = 0; n < 256; n++) {
-			unsigned int c = (unsigned int) n;
-			for (int k = 0; k < 8; k++) {
-				if (c & 1) {
-					c = 0xEDB88320 ^ (c >> 1);
-				} else {
-					c = c >> 1;
-				}
-			}
-			crc_table[n] = c;
-		}
+	void img::write_behind(img& im, int fd, size_t* flushed, size_t complete) {
+		if (complete < *flushed + IMG_WRITE_BEHIND_SIZE && complete < im.bsize) return;
 		
-		unsigned int crc = 0xFFFFFFFF;
+		// Only whole pages are written back, except at the very end.
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t end = complete < im.bsize ? complete / page * page : im.bsize;
+		if (end <= *flushed) return;
 		
-		for (int i = 0; i < datan; i++) {
-			crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
-		}
+		unsigned char* start = im.data + *flushed;
+		size_t len = end - *flushed;
 		
-		free(crc_table);
+		if (fd >= 0) {
+#ifdef SYNC_FILE_RANGE_WRITE
+			sync_file_range(fd, *flushed, len, SYNC_FILE_RANGE_WRITE);
+#else
+			msync(start, len, MS_ASYNC);
+#endif
+			// Dirty pages stay in the page cache until they are written, so dropping them from the mapping loses nothing.
+			madvise(start, len, MADV_DONTNEED);
+		} else {
+			msync(start, len, MS_ASYNC);
+		}
 		
-		return crc ^ 0xFFFFFFFF;
+		*flushed = end;
+	}
+	
+	// I can't say I really understand this function fully. But I do know that it gave me too much grief to be worth looking into further.
+	// Turns out the bit shift operator is undefined for negative integers, so crc has to be unsigned. Who could've guessed? Also, remember to use "%08x" for hexadecimal, not just "%x"
+	int img::png_crc(unsigned char* data, int datan) {
+		return png_crc_update(0xFFFFFFFF, data, datan) ^ 0xFFFFFFFF;
 	}
 	
 	void img::swap(unsigned char* a) {
@@ -299,23 +1290,3 @@ namespace img {
 		temp = a[1]; a[1] = a[2]; a[2] = temp;
 	}
 }
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
@@ -3,6 +3,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include "zlib.hpp"
 
@@ -12,17 +25,303 @@
 // -3 : Appears to have been corrupted.
 // -4 : Encountered unrecognized format or requested to perform unsupported actions.
 // -5 : Encountered corrupted data (Usually caused by a failed checksum)
+// -6 : Failed to allocate memory or map the output file.
 
 namespace img {
+	// When the CRCs of IDAT chunks are checked.
+	// PNG_CRC_SERIAL checks each chunk before it is inflated. PNG_CRC_SLICED alternates between checking and inflating slices of IMG_CRC_SLICE bytes, so each slice is inflated while it is still in cache. PNG_CRC_THREAD checks the chunks on a helper thread while they are inflated, which pays off for large images.
+	// In the pipelined modes, corrupted data may be inflated before the corruption is found, but load_png() still fails with -5.
+	enum png_crc_mode {PNG_CRC_SERIAL, PNG_CRC_SLICED, PNG_CRC_THREAD};
+	
+	// Which CRCs are skipped, for input whose integrity is already known (e.g. content-addressed data whose hash has been checked).
+	// PNG_TRUST_ANCILLARY skips the CRCs of ancillary chunks, PNG_TRUST_ALL skips every CRC.
+	enum png_trust {PNG_TRUST_NONE, PNG_TRUST_ANCILLARY, PNG_TRUST_ALL};
+	
+	// Options which change how load_png() decodes an image.
+	class png_opts {
+	public:
+		// Integer downscale factor. When greater than 1, each scale x scale block of source pixels is averaged into one output pixel while the scanlines are being decoded, so the full-resolution image is never stored.
+		// The resulting image is ceil(width/scale) x ceil(height/scale). Blocks on the right and bottom edges are averaged over the pixels they actually contain.
+		unsigned int scale;
+		
+		// Trade quality for speed when downscaling Adam-7 images by an even scale. Only the pixels on a grid of 8, 4 or 2 (the largest step that divides the scale) are averaged, as they are complete after pass 1, 3 or 5 and the later passes can be skipped. A scale of 2, 4 or 8 then point-samples the image, which aliases.
+		// Off by default, in which case every pixel is averaged whatever the interlacing.
+		bool early_passes;
+		
+		// If either of these is non-zero, the scale is raised to the smallest factor that makes the image fit inside max_width x max_height.
+		unsigned int max_width;
+		unsigned int max_height;
+		
+		// Region of the image to decode. If crop_w or crop_h is 0, the whole image is decoded.
+		// Only the rectangle is stored, it is downscaled afterwards if a scale is also given. Scanlines below the rectangle are never inflated, and columns to its right are never unfiltered.
+		unsigned int crop_x;
+		unsigned int crop_y;
+		unsigned int crop_w;
+		unsigned int crop_h;
+		
+		// Decode straight into this file instead of into malloc()ed memory. The file is created (or truncated) to im.bsize bytes and mapped, and finished rows are handed to the kernel for writing as decoding goes, which allows images larger than memory to be decoded.
+		// im.data stays valid as a mapping of the file after load_png() returns.
+		char* out_fn;
+		
+		// Decode into memory provided by the caller, for instance a MAP_SHARED mapping of a sparse file. out_map_len must be at least im.bsize, if it is not, load_png() fails with -4 after setting im.bsize so the mapping can be resized.
+		// Finished rows are passed to msync() asynchronously, so out_map must start on a page boundary, as mmap() returns it. The caller remains responsible for unmapping it.
+		unsigned char* out_map;
+		size_t out_map_len;
+		
+		png_crc_mode crc_mode;
+		png_trust trust;
+		
+		// Sets scale to 1 and everything else to 0, false or NULL, i.e. a normal full-resolution decode into malloc()ed memory with every CRC checked before use.
+		png_opts();
+	};
+	
+	// One of the reduced images making up a PNG image. Non-interlaced images consist of a single pass with a step of 1 in both directions, Adam-7 images consist of 7 passes.
+	class png_pass {
+	public:
+		// Position of the first pixel of the pass in the full image, and the distance between pixels of the pass.
+		unsigned char x0, y0, dx, dy;
+		
+		// Size of this reduced image in pixels. Either may be 0, in which case the pass is empty and contributes no bytes to the stream.
+		unsigned int width;
+		unsigned int height;
+	};
+	
+	// Receives reconstructed scanlines from a png_scanlines object.
+	class png_row_sink {
+	public:
+		// Called once for each scanline, in stream order. y is the row within the pass, px is the unfiltered row without its filter-type byte.
+		virtual void row(const png_pass& pass, unsigned int y, const unsigned char* px) = 0;
+		
+		// Number of leading bytes of the destination which are final and will not be written again. Used to write decoded images out to disk while decoding continues.
+		virtual size_t complete() {return 0;}
+		
+		// Whether the buffers of the sink, and of any sink it forwards to, could be allocated.
+		virtual bool allocated() {return true;}
+		
+		virtual ~png_row_sink() {}
+	};
+	
+	// Reassembles the inflated image data into scanlines, reverses the per-scanline filtering, and passes each reconstructed row to a sink.
+	// Inflated data may be pushed in pieces of any size, scanlines which span two pieces are held back until they are complete.
+	class png_scanlines {
+	public:
+		// bits_pp is the number of bits per pixel (bit depth times channels).
+		png_scanlines(unsigned int width, unsigned int height, unsigned char bits_pp, bool interlaced, png_row_sink* sink);
+		
+		// Decoding stops once this pass (1-7) is complete, which allows Adam-7 images to be decoded at reduced resolution from the early passes alone. Ignored for non-interlaced images.
+		unsigned char last_pass;
+		
+		// Restrict decoding to pixels left of max_x and above max_y. Must be called before the first push().
+		// Filters only ever refer to pixels above and to the left, so columns from max_x on are left unfiltered and whatever lies below max_y in each pass is discarded without being unfiltered.
+		void clip(unsigned int max_x, unsigned int max_y);
+		
+		// Feed n bytes of inflated data. Returns false if a scanline has an invalid filter type.
+		// Bytes that arrive after decoding is done are ignored.
+		bool push(const unsigned char* bytes, size_t n);
+		
+		// Whether every requested scanline has been passed to the sink.
+		bool done();
+		
+		// Whether the scanline buffers and those of the sink could be allocated. Nothing may be pushed otherwise.
+		bool allocated();
+		
+		~png_scanlines();
+		
+	private:
+		png_row_sink* sink;
+		
+		unsigned int max_x;
+		unsigned int max_y;
+		
+		bool interlaced;
+		png_pass passes[7];
+		unsigned char pass;
+		unsigned int y;
+		
+		// Bytes per complete pixel, rounded up to 1. This is the distance used by the Sub, Average and Paeth filters.
+		unsigned char fbpp;
+		unsigned char bits_pp;
+		
+		// Current and previous scanline, each prefixed with its filter-type byte. fill is the number of bytes of cur received so far, cap is the size of each buffer.
+		unsigned char* cur;
+		unsigned char* prev;
+		size_t fill;
+		size_t cap;
+		
+		// Number of inflated bytes which belong to clipped scanlines and are to be thrown away.
+		size_t skip;
+		
+		size_t row_bytes(const png_pass& p);
+		
+		// Skip ahead to the next scanline the sink needs, jumping over empty passes and clipped rows. The previous scanline is cleared whenever a new pass begins.
+		void advance();
+		
+		bool unfilter(size_t n);
+	};
+	
+	// Copies rows into an image buffer. Rows belonging to an Adam-7 pass are scattered to their positions in the full image.
+	// With a grid step greater than 1, only pixels whose coordinates are both multiples of the step are kept, and are stored in a (width/grid) x (height/grid) buffer.
+	class png_copy_sink : public png_row_sink {
+	public:
+		png_copy_sink(unsigned char* dst, size_t pitch, unsigned char bpp, unsigned int grid);
+		
+		void row(const png_pass& pass, unsigned int y, const unsigned char* px);
+		
+		// Rows of an Adam-7 image may still be filled in by later passes, so this only advances for non-interlaced images.
+		size_t complete();
+		
+	private:
+		unsigned char* dst;
+		size_t pitch;
+		unsigned char bpp;
+		unsigned int grid;
+		
+		size_t done;
+	};
+	
+	// Forwards the part of each row which lies inside a rectangle to another sink, as if the rectangle were an image of its own.
+	// Adam-7 pass rows are forwarded as rows of a pass whose origin has been moved to the first of its pixels inside the rectangle.
+	class png_crop_sink : public png_row_sink {
+	public:
+		png_crop_sink(unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned char bits_pp, png_row_sink* next);
+		
+		void row(const png_pass& pass, unsigned int y, const unsigned char* px);
+		
+		bool allocated();
+		
+		~png_crop_sink();
+		
+	private:
+		unsigned int x;
+		unsigned int y;
+		unsigned int w;
+		unsigned int h;
+		unsigned char bits_pp;
+		
+		png_row_sink* next;
+		
+		// Holds the cropped row.
+		unsigned char* buf;
+	};
+	
+	// Area-averages rows into an image scale times smaller in both directions, keeping only one row of running sums in memory.
+	// Only byte-aligned samples (8 or 16 bits, the latter stored big-endian as in PNG) can be averaged.
+	class png_box_sink : public png_row_sink {
+	public:
+		png_box_sink(unsigned int width, unsigned int height, unsigned int scale, unsigned char channels, unsigned char bit_depth, unsigned char* dst, size_t pitch);
+		
+		// Rows are expected in order from top to bottom, the pass and y arguments are ignored.
+		void row(const png_pass& pass, unsigned int y, const unsigned char* px);
+		void add_row(const unsigned char* px);
+		
+		size_t complete();
+		
+		bool allocated();
+		
+		~png_box_sink();
+		
+	private:
+		unsigned int width;
+		unsigned int height;
+		unsigned int scale;
+		unsigned char channels;
+		unsigned char bit_depth;
+		
+		unsigned char* dst;
+		size_t pitch;
+		
+		// One running sum per output sample, and the number of source rows summed so far.
+		unsigned long long* acc;
+		unsigned int acc_rows;
+		unsigned int src_y;
+		unsigned int dst_y;
+		
+		void flush();
+	};
+	
+	// Area-averages rows which arrive in any order, such as the passes of an Adam-7 image, into an image scale times smaller in both directions. One running sum is kept per output sample, so memory use depends only on the size of the output.
+	// Only pixels whose coordinates are both multiples of grid are summed, grid has to divide scale. The averages are written to dst by finish(), once every row has been added.
+	class png_sum_sink : public png_row_sink {
+	public:
+		png_sum_sink(unsigned int width, unsigned int height, unsigned int scale, unsigned int grid, unsigned char channels, unsigned char bit_depth, unsigned char* dst, size_t pitch);
+		
+		void row(const png_pass& pass, unsigned int y, const unsigned char* px);
+		
+		bool allocated();
+		
+		void finish();
+		
+		~png_sum_sink();
+		
+	private:
+		unsigned int width;
+		unsigned int height;
+		unsigned int scale;
+		unsigned int grid;
+		unsigned char channels;
+		unsigned char bit_depth;
+		
+		unsigned char* dst;
+		size_t pitch;
+		
+		// Size of the output, and one running sum per output sample. The sums are 32 bits wide, unless a block holds so many grid points of 16 bit samples that they could overflow.
+		unsigned int out_width;
+		unsigned int out_height;
+		void* acc;
+		bool wide;
+		
+		template <class T> void add(T* sums, const png_pass& pass, unsigned int iy, const unsigned char* px);
+		template <class T> void average(const T* sums);
+	};
+	
+	// Checks chunk CRCs on a helper thread.
+	class png_crc_checker {
+	public:
+		// Starts the thread.
+		png_crc_checker();
+		
+		// Queue the n bytes of buf (chunk type and data) to be checked against crc. buf is kept alive until it has been checked.
+		void check(std::shared_ptr<unsigned char> buf, size_t n, unsigned int crc);
+		
+		// Whether a chunk has failed its check so far.
+		bool failed();
+		
+		// Wait for the queued chunks to be checked and stop the thread. Returns false if any of them failed, in which case type receives the 4-letter name of the first one that did.
+		bool finish(char* type);
+		
+		~png_crc_checker();
+		
+	private:
+		class job {
+		public:
+			std::shared_ptr<unsigned char> buf;
+			size_t n;
+			unsigned int crc;
+		};
+		
+		std::mutex lock;
+		std::condition_variable wake;
+		std::deque<job> jobs;
+		bool stop;
+		
+		std::atomic<bool> bad;
+		char bad_type[5];
+		
+		std::thread worker;
+		
+		void run();
+	};
+	
 	class img {
 	public:
 		unsigned int width;
 		unsigned int height;
 		
 		// Bytes per pixel, pitch, and size.
+		// For bit depths below 8, bpp is 1 and rows are packed as in the PNG file.
 		unsigned char bpp;
-		unsigned int pitch;
-		unsigned int bsize;
+		size_t pitch;
+		size_t bsize;
 		
 		bool is_RGB;
 		
@@ -39,19 +338,39 @@ namespace img {
 		int palette_length;
 		unsigned char* palette;
 		
+		// Contents of the tRNS chunk, for alpha_mode 2 and 3. For palette images one alpha value per palette entry (entries past trns_length are opaque), otherwise the gray or RGB sample value which is transparent, as 2 or 6 bytes of 16 bit big-endian numbers.
+		// Downscaled images keep it as it is, though averaged samples rarely match the transparent value.
+		int trns_length;
+		unsigned char* trns;
+		
 		// Raw decompressed image data.
 		unsigned char* data;
 		
+		// Where data came from, which determines how the destructor releases it.
+		// 0: malloc(), 1: mmap() of png_opts::out_fn, 2: png_opts::out_map, which belongs to the caller and is left alone.
+		unsigned char data_mode;
+		
 		// Just sets pointers to NULL so the destructor knows not to try and free() them
 		img();
 		
 		// Load a PNG image
+		// Returns &im on success. On failure, returns NULL and sets errcd to one of the error codes above.
 		static img* load_png(char* fn, img& im, int verbose, int* errcd);
+		static img* load_png(char* fn, img& im, const png_opts& opts, int verbose, int* errcd);
+		
+		// Load only the w x h rectangle whose top-left corner is at (x, y).
+		static img* load_png(char* fn, img& im, unsigned int x, unsigned int y, unsigned int w, unsigned int h, int verbose, int* errcd);
+		
+		// Load a PNG image from a stream which is already open, for instance one created by fmemopen() over a file read into memory. The stream is read from its current position and left open. fn is only used in messages.
+		static img* load_png(FILE* fp, char* fn, img& im, const png_opts& opts, int verbose, int* errcd);
 		
 		~img();
 	private:
+		// The APNG reader in apng.hpp parses chunks with the same helpers.
+		friend class apng;
+		
 		// Allows chunk names to be detected using 4-byte integer comparison
-		enum png_chnk_type : unsigned int {IHDR = 0x49484452, PLTE = 0x504C5445, IDAT = 0x49444154, IEND = 0x49454E44, tEXt = 0x74455874};
+		enum png_chnk_type : unsigned int {IHDR = 0x49484452, PLTE = 0x504C5445, IDAT = 0x49444154, IEND = 0x49454E44, tEXt = 0x74455874, tRNS = 0x74524E53, acTL = 0x6163544C, fcTL = 0x6663544C, fdAT = 0x66644154};
 		
 		// Calculates and returns the 32 bit CRC for a buffer of data as used by the PNG specification
 		// datan is the size of the data in bytes.
@@ -59,6 +378,10 @@ namespace img {
 		
 		// Changes the endianness of the passed int.
 		inline static void swap(unsigned char* a);
+		
+		// Start writing the first complete bytes of a mapped im.data back to disk, once at least IMG_WRITE_BEHIND_SIZE bytes have accumulated since the last call (or the whole image is complete).
+		// Pages of a file mapped by load_png() are then dropped, so memory use stays bounded no matter how large the image is. fd is -1 for mappings provided by the caller.
+		static void write_behind(img& im, int fd, size_t* flushed, size_t complete);
 	};
 }
 
@@ -0,0 +1,547 @@
+#if defined(__x86_64__) || defined(__i386__)
+#define IMG_RESIZE_X86
+#endif
+
+namespace img {
+	/* Filters */
+	
+	static double resize_sinc(double x) {
+		if (x == 0) return 1;
+		x *= M_PI;
+		return sin(x) / x;
+	}
+	
+	// Returns the number of input samples on either side of the center which the filter reaches, before it is stretched for downscaling.
+	static double resize_support(resize_filter filter) {
+		switch (filter) {
+			case RESIZE_BILINEAR:
+				return 1;
+			case RESIZE_BICUBIC:
+				return 2;
+			case RESIZE_LANCZOS3:
+				return 3;
+			default:
+				return 0.5;
+		}
+	}
+	
+	static double resize_kernel(resize_filter filter, double x) {
+		x = fabs(x);
+		
+		switch (filter) {
+			case RESIZE_BILINEAR:
+				return x < 1 ? 1 - x : 0;
+			// Keys' cubic convolution with a = -0.5
+			case RESIZE_BICUBIC:
+				if (x < 1) return (1.5*x - 2.5)*x*x + 1;
+				if (x < 2) return ((-0.5*x + 2.5)*x - 4)*x + 2;
+				return 0;
+			case RESIZE_LANCZOS3:
+				return x < 3 ? resize_sinc(x) * resize_sinc(x / 3) : 0;
+			default:
+				return x < 0.5 ? 1 : 0;
+		}
+	}
+	
+	/* resize_coefs */
+	
+	resize_coefs::resize_coefs(unsigned int src_n, unsigned int dst_n, resize_filter filter) : dst_n(dst_n), taps(0), start(NULL), count(NULL), coef(NULL) {
+		if (src_n == 0 || dst_n == 0) return;
+		
+		// When shrinking, the filter is stretched to cover every input sample that falls inside an output sample.
+		double scale = (double) src_n / dst_n;
+		double filterscale = scale > 1 ? scale : 1;
+		double support = resize_support(filter) * filterscale;
+		
+		// No output sample can use more than every input sample, which also keeps huge downscaling factors from overflowing taps.
+		double reach = ceil(support * 2) + 1;
+		taps = filter == RESIZE_NEAREST ? 1 : reach < src_n ? (unsigned int) reach : src_n;
+		
+		start = (unsigned int*) malloc(dst_n * sizeof(unsigned int));
+		count = (unsigned int*) malloc(dst_n * sizeof(unsigned int));
+		coef = (float*) calloc((size_t) dst_n * taps, sizeof(float));
+		
+		double* w = (double*) malloc(taps * sizeof(double));
+		if (!allocated() || w == NULL) {
+			free(start);
+			free(count);
+			free(coef);
+			free(w);
+			start = NULL;
+			count = NULL;
+			coef = NULL;
+			return;
+		}
+		
+		double center;
+		double total;
+		int lo, hi;
+		
+		for (unsigned int i = 0; i < dst_n; i++) {
+			center = (i + 0.5) * scale;
+			
+			lo = (int) (center - support + 0.5);
+			hi = (int) (center + support + 0.5);
+			if (lo < 0) lo = 0;
+			if (hi > (int) src_n) hi = src_n;
+			if (hi - lo > (int) taps) hi = lo + taps;
+			
+			total = 0;
+			if (filter != RESIZE_NEAREST) {
+				for (int k = 0; k < hi - lo; k++) {
+					w[k] = resize_kernel(filter, (lo + k - center + 0.5) / filterscale);
+					total += w[k];
+				}
+			}
+			
+			// Nearest neighbor, or a filter which happens to be zero everywhere it touches, takes the one sample the center lies in.
+			if (total == 0) {
+				start[i] = center < src_n ? (unsigned int) center : src_n - 1;
+				count[i] = 1;
+				coef[(size_t) i * taps] = 1;
+				continue;
+			}
+			
+			start[i] = lo;
+			count[i] = hi - lo;
+			for (int k = 0; k < hi - lo; k++) {
+				coef[(size_t) i * taps + k] = w[k] / total;
+			}
+		}
+		
+		free(w);
+	}
+	
+	bool resize_coefs::allocated() {
+		return start != NULL && count != NULL && coef != NULL;
+	}
+	
+	resize_coefs::~resize_coefs() {
+		free(start);
+		free(count);
+		free(coef);
+	}
+	
+	/* Row kernels */
+	// Each kernel has a plain C++ version, and where it pays off an SSE or AVX2 version. AVX2 versions are compiled for AVX2 regardless of the compiler flags, and only called if the CPU supports it.
+
+#ifdef IMG_RESIZE_X86
+	static bool resize_has_avx2() {
+		static const bool has = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+		return has;
+	}
+	
+	// Reverses the bytes of each 16 bit lane, converting between big-endian samples and native integers.
+	#define IMG_RESIZE_SWAP16 _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14)
+	
+	__attribute__((target("avx2"))) static size_t resize_load_row_avx2(const unsigned char* px, float* out, size_t n, unsigned char bit_depth) {
+		size_t i = 0;
+		__m128i v;
+		
+		if (bit_depth == 16) {
+			for (; i + 8 <= n; i += 8) {
+				v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (px + 2*i)), IMG_RESIZE_SWAP16);
+				_mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(v)));
+			}
+		} else {
+			for (; i + 8 <= n; i += 8) {
+				v = _mm_loadl_epi64((const __m128i*) (px + i));
+				_mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)));
+			}
+		}
+		
+		return i;
+	}
+	
+	__attribute__((target("avx2"))) static size_t resize_store_row_avx2(const float* in, unsigned char* px, size_t n, unsigned char bit_depth) {
+		const __m256 lo = _mm256_setzero_ps();
+		const __m256 hi = _mm256_set1_ps(bit_depth == 16 ? 65535.0f : 255.0f);
+		
+		size_t i = 0;
+		__m256i v;
+		__m128i w;
+		
+		for (; i + 8 <= n; i += 8) {
+			v = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in + i), lo), hi));
+			w = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+			
+			if (bit_depth == 16) {
+				_mm_storeu_si128((__m128i*) (px + 2*i), _mm_shuffle_epi8(w, IMG_RESIZE_SWAP16));
+			} else {
+				_mm_storel_epi64((__m128i*) (px + i), _mm_packus_epi16(w, w));
+			}
+		}
+		
+		return i;
+	}
+	
+	__attribute__((target("avx2,fma"))) static size_t resize_vert_avx2(float** rows, const float* w, unsigned int n, float* out, size_t len) {
+		size_t i = 0;
+		__m256 acc;
+		
+		for (; i + 8 <= len; i += 8) {
+			acc = _mm256_setzero_ps();
+			for (unsigned int k = 0; k < n; k++) {
+				acc = _mm256_fmadd_ps(_mm256_set1_ps(w[k]), _mm256_loadu_ps(rows[k] + i), acc);
+			}
+			_mm256_storeu_ps(out + i, acc);
+		}
+		
+		return i;
+	}
+	
+	// Lane masks for the last 1 to 7 elements of a row: resize_tail + 8 - m enables the first m lanes.
+	static const int resize_tail[16] = {-1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0};
+	
+	// One output pixel at a time. Single channel pixels take the dot product of the weights and 8 samples per step. With 2 channels, 4 pixels are handled per step and each weight is used for both of their channels.
+	// With 3 or 4 channels, 2 pixels are handled per step, one in each half of the register. As in the SSE version, the 4th lane of a 3 channel pixel is ignored.
+	__attribute__((target("avx2,fma"))) static void resize_horiz_avx2(const float* in, float* out, const resize_coefs& c, unsigned char ch) {
+		const __m256i dup = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+		
+		const float* w;
+		const float* s;
+		unsigned int n;
+		unsigned int k;
+		__m256 acc;
+		__m256i m;
+		__m128 r;
+		
+		for (unsigned int x = 0; x < c.dst_n; x++) {
+			w = c.coef + (size_t) x * c.taps;
+			s = in + (size_t) c.start[x] * ch;
+			n = c.count[x];
+			acc = _mm256_setzero_ps();
+			k = 0;
+			
+			if (ch == 1) {
+				for (; k + 8 <= n; k += 8) {
+					acc = _mm256_fmadd_ps(_mm256_loadu_ps(w + k), _mm256_loadu_ps(s + k), acc);
+				}
+				if (k < n) {
+					m = _mm256_loadu_si256((const __m256i*) (resize_tail + 8 - (n - k)));
+					acc = _mm256_fmadd_ps(_mm256_maskload_ps(w + k, m), _mm256_maskload_ps(s + k, m), acc);
+				}
+				
+				r = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+				r = _mm_add_ps(r, _mm_movehl_ps(r, r));
+				r = _mm_add_ss(r, _mm_shuffle_ps(r, r, 1));
+				out[x] = _mm_cvtss_f32(r);
+			}
+			else if (ch == 2) {
+				for (; k + 4 <= n; k += 4) {
+					acc = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(_mm256_castps128_ps256(_mm_loadu_ps(w + k)), dup), _mm256_loadu_ps(s + 2*k), acc);
+				}
+				if (k < n) {
+					__m128 wv = _mm_maskload_ps(w + k, _mm_loadu_si128((const __m128i*) (resize_tail + 8 - (n - k))));
+					m = _mm256_loadu_si256((const __m256i*) (resize_tail + 8 - 2*(n - k)));
+					acc = _mm256_fmadd_ps(_mm256_permutevar8x32_ps(_mm256_castps128_ps256(wv), dup), _mm256_maskload_ps(s + 2*k, m), acc);
+				}
+				
+				r = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+				r = _mm_add_ps(r, _mm_movehl_ps(r, r));
+				_mm_storel_pi((__m64*) (out + (size_t) x * 2), r);
+			}
+			else {
+				for (; k + 2 <= n; k += 2) {
+					__m256 sv = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(s + k*ch)), _mm_loadu_ps(s + (k+1)*ch), 1);
+					__m256 wv = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(w[k])), _mm_set1_ps(w[k+1]), 1);
+					acc = _mm256_fmadd_ps(wv, sv, acc);
+				}
+				
+				r = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+				if (k < n) {
+					r = _mm_fmadd_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(s + k*ch), r);
+				}
+				_mm_storeu_ps(out + (size_t) x * ch, r);
+			}
+		}
+	}
+#endif
+
+	// Convert n samples to floats. 16 bit samples are big-endian, as stored by img::load_png().
+	static void resize_load_row(const unsigned char* px, float* out, size_t n, unsigned char bit_depth, bool simd) {
+		size_t i = 0;
+
+#ifdef IMG_RESIZE_X86
+		if (simd && resize_has_avx2()) {
+			i = resize_load_row_avx2(px, out, n, bit_depth);
+		}
+#endif
+
+		if (bit_depth == 16) {
+			for (; i < n; i++) {
+				out[i] = px[2*i] << 8 | px[2*i + 1];
+			}
+		} else {
+			for (; i < n; i++) {
+				out[i] = px[i];
+			}
+		}
+	}
+	
+	// Round, clamp and convert n floats back to samples.
+	static void resize_store_row(const float* in, unsigned char* px, size_t n, unsigned char bit_depth, bool simd) {
+		size_t i = 0;
+		float max = bit_depth == 16 ? 65535.0f : 255.0f;
+		float v;
+		unsigned int s;
+
+#ifdef IMG_RESIZE_X86
+		if (simd && resize_has_avx2()) {
+			i = resize_store_row_avx2(in, px, n, bit_depth);
+		}
+#endif
+
+		for (; i < n; i++) {
+			v = in[i];
+			if (v < 0) v = 0;
+			if (v > max) v = max;
+			s = (unsigned int) lrintf(v);
+			
+			if (bit_depth == 16) {
+				px[2*i] = s >> 8;
+				px[2*i + 1] = s & 0xFF;
+			} else {
+				px[i] = s;
+			}
+		}
+	}
+	
+	// Resample one row of floats horizontally.
+	// Both rows need one float of padding at the end: with 3 channels, each pixel is handled as 4 floats, the 4th of which is ignored and later overwritten by the next pixel.
+	// Without AVX2, only 3 and 4 channel pixels are vectorized, with SSE.
+	static void resize_horiz(const float* in, float* out, const resize_coefs& c, unsigned char ch, bool simd) {
+		const float* w;
+		const float* s;
+		float acc;
+
+#ifdef IMG_RESIZE_X86
+		if (simd && resize_has_avx2()) {
+			resize_horiz_avx2(in, out, c, ch);
+			return;
+		}
+		if (simd && (ch == 3 || ch == 4)) {
+			__m128 v;
+			for (unsigned int x = 0; x < c.dst_n; x++) {
+				w = c.coef + (size_t) x * c.taps;
+				s = in + (size_t) c.start[x] * ch;
+				
+				v = _mm_setzero_ps();
+				for (unsigned int k = 0; k < c.count[x]; k++) {
+					v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(s + k*ch)));
+				}
+				_mm_storeu_ps(out + (size_t) x * ch, v);
+			}
+			return;
+		}
+#endif
+
+		for (unsigned int x = 0; x < c.dst_n; x++) {
+			w = c.coef + (size_t) x * c.taps;
+			s = in + (size_t) c.start[x] * ch;
+			
+			for (int ci = 0; ci < ch; ci++) {
+				acc = 0;
+				for (unsigned int k = 0; k < c.count[x]; k++) {
+					acc += w[k] * s[k*ch + ci];
+				}
+				out[(size_t) x * ch + ci] = acc;
+			}
+		}
+	}
+	
+	// Combine n horizontally resampled rows into one output row of len floats.
+	static void resize_vert(float** rows, const float* w, unsigned int n, float* out, size_t len, bool simd) {
+		size_t i = 0;
+		float acc;
+
+#ifdef IMG_RESIZE_X86
+		if (simd && resize_has_avx2()) {
+			i = resize_vert_avx2(rows, w, n, out, len);
+		}
+#endif
+
+		for (; i < len; i++) {
+			acc = 0;
+			for (unsigned int k = 0; k < n; k++) {
+				acc += w[k] * rows[k][i];
+			}
+			out[i] = acc;
+		}
+	}
+	
+	// Alpha is always the last channel.
+	static void resize_premultiply(float* row, size_t pixels, unsigned char ch, float max) {
+		float a;
+		for (size_t p = 0; p < pixels; p++, row += ch) {
+			a = row[ch - 1] / max;
+			for (int c = 0; c < ch - 1; c++) {
+				row[c] *= a;
+			}
+		}
+	}
+	
+	static void resize_unpremultiply(float* row, size_t pixels, unsigned char ch, float max) {
+		float a;
+		for (size_t p = 0; p < pixels; p++, row += ch) {
+			a = row[ch - 1] > 0 ? max / row[ch - 1] : 0;
+			for (int c = 0; c < ch - 1; c++) {
+				row[c] *= a;
+			}
+		}
+	}
+	
+	/* resizer */
+	
+	// Whether a w x h image of bpp bytes per pixel can be addressed.
+	static bool resize_fits(unsigned int w, unsigned int h, unsigned char bpp) {
+		return w <= SIZE_MAX / bpp && (h == 0 || (size_t) w * bpp <= SIZE_MAX / h);
+	}
+	
+	// No tables are built for a target too large to be addressed in any format (8 bytes per pixel being the most), run() rejects it before they are needed.
+	resizer::resizer(unsigned int src_w, unsigned int src_h, unsigned int dst_w, unsigned int dst_h, resize_filter filter) : threads(0), premultiply(true), simd(true), src_w(src_w), src_h(src_h), dst_w(dst_w), dst_h(dst_h), horiz(src_w, resize_fits(dst_w, dst_h, 8) ? dst_w : 0, filter), vert(src_h, resize_fits(dst_w, dst_h, 8) ? dst_h : 0, filter) {}
+	
+	img* resizer::run(const img& src, img& dst, int* errcd) {
+		*errcd = 0;
+		
+		if (src.data == NULL || src.uses_palette || (src.bit_depth != 8 && src.bit_depth != 16)) {
+			*errcd = -4;
+			return NULL;
+		}
+		if (src.width != src_w || src.height != src_h || dst_w == 0 || dst_h == 0) {
+			*errcd = -4;
+			return NULL;
+		}
+		if (!resize_fits(dst_w, dst_h, src.bpp)) {
+			*errcd = -4;
+			return NULL;
+		}
+		if (!horiz.allocated() || !vert.allocated()) {
+			*errcd = -6;
+			return NULL;
+		}
+		
+		dst.width = dst_w;
+		dst.height = dst_h;
+		dst.bpp = src.bpp;
+		dst.pitch = (size_t) dst_w * src.bpp;
+		dst.bsize = dst.pitch * dst_h;
+		dst.is_RGB = src.is_RGB;
+		dst.uses_palette = false;
+		dst.alpha_mode = src.alpha_mode;
+		dst.bit_depth = src.bit_depth;
+		dst.palette_length = 0;
+		dst.palette = NULL;
+		
+		// The transparent sample value of a gray or RGB image (alpha_mode 3) carries over.
+		dst.trns_length = src.trns != NULL ? src.trns_length : 0;
+		dst.trns = src.trns != NULL ? (unsigned char*) malloc(src.trns_length) : NULL;
+		if (dst.trns != NULL) {
+			memcpy(dst.trns, src.trns, src.trns_length);
+		}
+		
+		dst.data = (unsigned char*) malloc(dst.bsize);
+		dst.data_mode = 0;
+		if (dst.data == NULL || (src.trns != NULL && dst.trns == NULL)) {
+			free(dst.data);
+			free(dst.trns);
+			dst.data = NULL;
+			dst.trns = NULL;
+			*errcd = -6;
+			return NULL;
+		}
+		
+		unsigned int n = threads;
+		if (n == 0) n = std::thread::hardware_concurrency();
+		if (n == 0) n = 1;
+		if (n > dst_h) n = dst_h;
+		
+		// Each thread produces a band of consecutive rows, the calling thread takes the first one.
+		std::atomic<bool> failed(false);
+		std::vector<std::thread> workers;
+		for (unsigned int t = 1; t < n; t++) {
+			unsigned int y0 = (unsigned long long) dst_h * t / n;
+			unsigned int y1 = (unsigned long long) dst_h * (t+1) / n;
+			workers.emplace_back([&, y0, y1]() {
+				if (!run_rows(src, dst, y0, y1)) failed = true;
+			});
+		}
+		if (!run_rows(src, dst, 0, dst_h / n)) failed = true;
+		
+		for (size_t t = 0; t < workers.size(); t++) {
+			workers[t].join();
+		}
+		
+		if (failed) {
+			free(dst.data);
+			dst.data = NULL;
+			*errcd = -6;
+			return NULL;
+		}
+		
+		return &dst;
+	}
+	
+	img* resizer::resize(const img& src, img& dst, unsigned int width, unsigned int height, resize_filter filter, int* errcd) {
+		resizer rs(src.width, src.height, width, height, filter);
+		return rs.run(src, dst, errcd);
+	}
+	
+	bool resizer::run_rows(const img& src, img& dst, unsigned int y0, unsigned int y1) {
+		if (y0 >= y1) return true;
+		
+		unsigned char ch = src.bpp / (src.bit_depth / 8);
+		bool pm = premultiply && src.alpha_mode == 1;
+		float max = src.bit_depth == 16 ? 65535.0f : 255.0f;
+		
+		size_t in_n = (size_t) src_w * ch;
+		size_t out_n = (size_t) dst_w * ch;
+		
+		// Horizontally resampled rows are kept in a ring of vert.taps rows, indexed by source row.
+		// The rows an output row needs only ever move downwards, so each source row in the band is resampled once.
+		float* row = (float*) calloc(in_n + 1, sizeof(float));
+		float* ring = vert.taps <= SIZE_MAX / (out_n + 1) ? (float*) calloc((out_n + 1) * vert.taps, sizeof(float)) : NULL;
+		float* out = (float*) malloc(out_n * sizeof(float));
+		float** rows = (float**) malloc(vert.taps * sizeof(float*));
+		
+		if (row == NULL || ring == NULL || out == NULL || rows == NULL) {
+			free(row);
+			free(ring);
+			free(out);
+			free(rows);
+			return false;
+		}
+		
+		unsigned int next = 0;
+		unsigned int s;
+		unsigned int n;
+		
+		for (unsigned int y = y0; y < y1; y++) {
+			s = vert.start[y];
+			n = vert.count[y];
+			
+			if (next < s) next = s;
+			for (; next < s + n; next++) {
+				resize_load_row(src.data + (size_t) next * src.pitch, row, in_n, src.bit_depth, simd);
+				if (pm) resize_premultiply(row, src_w, ch, max);
+				resize_horiz(row, ring + (size_t) (next % vert.taps) * (out_n + 1), horiz, ch, simd);
+			}
+			
+			for (unsigned int k = 0; k < n; k++) {
+				rows[k] = ring + (size_t) ((s + k) % vert.taps) * (out_n + 1);
+			}
+			
+			resize_vert(rows, vert.coef + (size_t) y * vert.taps, n, out, out_n, simd);
+			if (pm) resize_unpremultiply(out, dst_w, ch, max);
+			resize_store_row(out, dst.data + (size_t) y * dst.pitch, out_n, src.bit_depth, simd);
+		}
+		
+		free(row);
+		free(ring);
+		free(out);
+		free(rows);
+		return true;
+	}
+	
+	resizer::~resizer() {}
+}
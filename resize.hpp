@@ -0,0 +1,83 @@
+#ifndef img_resize
+#define img_resize
+
+#include <math.h>
+
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "img.hpp"
+
+// Resizing works on images with 8 or 16 bit samples, as produced by img::load_png(). Palette images and bit depths below 8 are not supported.
+// The same error codes as img.hpp are used.
+
+namespace img {
+	// Resampling filters, in increasing order of quality and cost.
+	enum resize_filter {RESIZE_NEAREST, RESIZE_BILINEAR, RESIZE_BICUBIC, RESIZE_LANCZOS3};
+	
+	// Weights for resampling along one axis.
+	// Output sample i is the weighted sum of count[i] consecutive input samples, starting at input sample start[i].
+	class resize_coefs {
+	public:
+		resize_coefs(unsigned int src_n, unsigned int dst_n, resize_filter filter);
+		
+		unsigned int dst_n;
+		
+		// Largest count of any output sample. Each output sample has taps entries in coef, of which only the first count[i] are used.
+		unsigned int taps;
+		
+		unsigned int* start;
+		unsigned int* count;
+		float* coef;
+		
+		// Whether the tables could be allocated. They are left empty if there are no output samples.
+		bool allocated();
+		
+		~resize_coefs();
+	};
+	
+	// Resizes images with a separable filter: each row is resampled horizontally, then the resampled rows are combined vertically.
+	// The coefficient tables only depend on the sizes and the filter, so a resizer can be reused for any number of images of the same size.
+	class resizer {
+	public:
+		resizer(unsigned int src_w, unsigned int src_h, unsigned int dst_w, unsigned int dst_h, resize_filter filter);
+		
+		// Number of threads the output rows are split between. 0 (the default) uses one per hardware thread.
+		unsigned int threads;
+		
+		// For images with a true alpha channel (alpha_mode 1), weight the color channels by alpha while resampling, so that the color of transparent pixels does not bleed into their neighbors. On by default.
+		bool premultiply;
+		
+		// Use the SSE and AVX2 kernels where the CPU supports them. On by default, turning it off runs the plain C++ kernels, whose results may differ by rounding.
+		bool simd;
+		
+		// Resize src, which must be src_w x src_h, into dst. dst receives a newly allocated image in the same format as src.
+		// Returns &dst on success. On failure, returns NULL and sets errcd.
+		img* run(const img& src, img& dst, int* errcd);
+		
+		// Resize an image once, without keeping the coefficient tables around.
+		static img* resize(const img& src, img& dst, unsigned int width, unsigned int height, resize_filter filter, int* errcd);
+		
+		~resizer();
+	private:
+		unsigned int src_w;
+		unsigned int src_h;
+		unsigned int dst_w;
+		unsigned int dst_h;
+		
+		resize_coefs horiz;
+		resize_coefs vert;
+		
+		// Produce output rows y0 up to (not including) y1. Each thread calls this for its own band of rows.
+		// Returns false if its buffers could not be allocated.
+		bool run_rows(const img& src, img& dst, unsigned int y0, unsigned int y1);
+	};
+}
+
+#include "resize.cpp"
+
+#endif
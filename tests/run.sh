@@ -0,0 +1,32 @@
+#!/bin/sh
+# Builds and runs every test in this directory. There is no build system, each test is a single translation unit:
+#   g++ -std=c++17 -pthread tests/test_png.cpp -o test_png
+# Extra compiler flags can be passed in CXXFLAGS, and SANITIZE=1 builds with AddressSanitizer and UndefinedBehaviorSanitizer.
+# Usage: tests/run.sh [test_name ...]
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build=$(mktemp -d)
+trap 'rm -rf "$build"' EXIT
+
+flags="-std=c++17 -O2 -g -pthread $CXXFLAGS"
+if [ -n "$SANITIZE" ]; then
+	flags="$flags -fsanitize=address,undefined -fno-sanitize-recover=undefined"
+fi
+
+if [ $# -eq 0 ]; then
+	set -- $(cd "$root/tests" && ls test_*.cpp | sed 's/\.cpp$//')
+fi
+
+failed=0
+for t in "$@"; do
+	if ! ${CXX:-g++} $flags -o "$build/$t" "$root/tests/$t.cpp"; then
+		echo "$t: build failed"
+		failed=1
+		continue
+	fi
+	if ! (cd "$root" && IMG_ROOT="$root" "$build/$t"); then
+		failed=1
+	fi
+done
+
+exit $failed
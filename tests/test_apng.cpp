@@ -0,0 +1,504 @@
+// Builds animated PNG files from random RGBA frames, and checks every canvas img::apng produces against frames composited by a plain implementation of the APNG specification.
+
+#include "../img.hpp"
+#include "../apng.hpp"
+#include "testing.hpp"
+
+using namespace testing;
+
+class test_frame {
+public:
+	unsigned int x, y, w, h;
+	unsigned char dispose;
+	unsigned char blend;
+	
+	// RGBA pixels with the sample size of the animation.
+	std::vector<unsigned char> px;
+};
+
+// Builds an APNG file of RGBA frames. With hidden_default, the file starts with a default image which is not part of the animation.
+class apng_writer {
+public:
+	unsigned int width;
+	unsigned int height;
+	unsigned char bit_depth;
+	bool hidden_default;
+	unsigned int num_plays;
+	
+	// Added to the sequence number of the chunk with this index, to write broken files.
+	int bad_seq;
+	int seq_offset;
+	
+	std::vector<test_frame> frames;
+	
+	apng_writer(unsigned int width, unsigned int height, unsigned char bit_depth) : width(width), height(height), bit_depth(bit_depth), hidden_default(false), num_plays(0), bad_seq(-1), seq_offset(0) {}
+	
+	std::vector<unsigned char> encode() {
+		png_writer pw(width, height, 6, bit_depth);
+		std::vector<unsigned char> f = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+		unsigned char d[26];
+		
+		put32(d, width);
+		put32(d + 4, height);
+		d[8] = bit_depth;
+		d[9] = 6;
+		d[10] = d[11] = d[12] = 0;
+		pw.chunk(f, "IHDR", d, 13);
+		
+		put32(d, frames.size());
+		put32(d + 4, num_plays);
+		pw.chunk(f, "acTL", d, 8);
+		
+		if (hidden_default) {
+			std::vector<unsigned char> z = compress(pw, pattern(pw.pitch() * height, 99));
+			pw.chunk(f, "IDAT", z.data(), z.size());
+		}
+		
+		unsigned int seq = 0;
+		for (size_t i = 0; i < frames.size(); i++) {
+			test_frame& fr = frames[i];
+			put32(d, next_seq(seq));
+			put32(d + 4, fr.w);
+			put32(d + 8, fr.h);
+			put32(d + 12, fr.x);
+			put32(d + 16, fr.y);
+			d[20] = 0;
+			d[21] = i + 1;
+			d[22] = 0;
+			d[23] = 100;
+			d[24] = fr.dispose;
+			d[25] = fr.blend;
+			pw.chunk(f, "fcTL", d, 26);
+			
+			png_writer fw(fr.w, fr.h, 6, bit_depth);
+			std::vector<unsigned char> z = compress(fw, fr.px);
+			
+			// Split into two chunks, to check that they are put back together.
+			size_t half = z.size() / 2;
+			size_t parts[2][2] = {{0, half}, {half, z.size() - half}};
+			for (auto& p : parts) {
+				if (i == 0 && !hidden_default) {
+					pw.chunk(f, "IDAT", z.data() + p[0], p[1]);
+					continue;
+				}
+				std::vector<unsigned char> fd(4);
+				put32(fd.data(), next_seq(seq));
+				fd.insert(fd.end(), z.begin() + p[0], z.begin() + p[0] + p[1]);
+				pw.chunk(f, "fdAT", fd.data(), fd.size());
+			}
+		}
+		
+		pw.chunk(f, "IEND", NULL, 0);
+		return f;
+	}
+
+private:
+	static void put32(unsigned char* p, unsigned int v) {
+		p[0] = v >> 24;
+		p[1] = v >> 16;
+		p[2] = v >> 8;
+		p[3] = v;
+	}
+	
+	unsigned int next_seq(unsigned int& seq) {
+		unsigned int s = seq++;
+		return (int) s == bad_seq ? s + seq_offset : s;
+	}
+	
+	static std::vector<unsigned char> compress(const png_writer& pw, const std::vector<unsigned char>& px) {
+		std::vector<unsigned char> s = pw.scanlines(px);
+		return zlib_compress(s.data(), s.size(), ZLIB_FIXED);
+	}
+};
+
+// Alpha values which exercise every path of the blending code: transparent, opaque, and in between.
+static unsigned int random_alpha(rng& r, unsigned int max) {
+	switch (r.below(4)) {
+		case 0:
+			return 0;
+		case 1:
+			return max;
+		default:
+			return r.below(max + 1);
+	}
+}
+
+static test_frame random_frame(rng& r, const apng_writer& aw, bool full) {
+	test_frame f;
+	f.w = full ? aw.width : 1 + r.below(aw.width);
+	f.h = full ? aw.height : 1 + r.below(aw.height);
+	f.x = full ? 0 : r.below(aw.width - f.w + 1);
+	f.y = full ? 0 : r.below(aw.height - f.h + 1);
+	f.dispose = r.below(3);
+	f.blend = r.below(2);
+	
+	unsigned int max = aw.bit_depth == 16 ? 65535 : 255;
+	unsigned int bytes = aw.bit_depth / 8;
+	f.px.resize((size_t) f.w * f.h * 4 * bytes);
+	
+	// Rows of 4 or more pixels with the same alpha, so that the blending code sees runs of opaque and transparent pixels.
+	unsigned int alpha = 0;
+	for (size_t p = 0; p < (size_t) f.w * f.h; p++) {
+		if (p % 5 == 0) alpha = random_alpha(r, max);
+		unsigned int v[4] = {r.below(max + 1), r.below(max + 1), r.below(max + 1), alpha};
+		for (int c = 0; c < 4; c++) {
+			for (unsigned int b = 0; b < bytes; b++) {
+				f.px[(p * 4 + c) * bytes + b] = v[c] >> (8 * (bytes - 1 - b));
+			}
+		}
+	}
+	return f;
+}
+
+// The APNG specification's blend of one pixel over another, in integers.
+static void over(unsigned char* d, const unsigned char* s, unsigned char bit_depth) {
+	unsigned int bytes = bit_depth / 8;
+	unsigned long long max = bit_depth == 16 ? 65535 : 255;
+	unsigned long long v[2][4];
+	for (int c = 0; c < 4; c++) {
+		v[0][c] = bytes == 2 ? s[2*c] << 8 | s[2*c+1] : s[c];
+		v[1][c] = bytes == 2 ? d[2*c] << 8 | d[2*c+1] : d[c];
+	}
+	
+	unsigned long long a = v[0][3];
+	unsigned long long a2 = v[1][3];
+	if (a == 0) return;
+	if (a == max || a2 == 0) {
+		memcpy(d, s, 4 * bytes);
+		return;
+	}
+	
+	unsigned long long u = a * max;
+	unsigned long long w = (max - a) * a2;
+	unsigned long long out[4];
+	for (int c = 0; c < 3; c++) {
+		out[c] = (v[0][c] * u + v[1][c] * w) / (u + w);
+	}
+	out[3] = (u + w) / max;
+	
+	for (int c = 0; c < 4; c++) {
+		if (bytes == 2) {
+			d[2*c] = out[c] >> 8;
+			d[2*c+1] = out[c];
+		} else {
+			d[c] = out[c];
+		}
+	}
+}
+
+// The canvas after each frame, composited from scratch.
+static std::vector<std::vector<unsigned char> > reference(const apng_writer& aw) {
+	size_t bpp = 4 * aw.bit_depth / 8;
+	size_t pitch = aw.width * bpp;
+	std::vector<unsigned char> canvas(pitch * aw.height, 0);
+	std::vector<unsigned char> saved;
+	std::vector<std::vector<unsigned char> > out;
+	
+	for (size_t i = 0; i < aw.frames.size(); i++) {
+		const test_frame& f = aw.frames[i];
+		
+		// The first frame's dispose_op of previous means background.
+		unsigned char dispose = i == 0 && f.dispose == 2 ? 1 : f.dispose;
+		saved = canvas;
+		
+		for (unsigned int y = 0; y < f.h; y++) {
+			for (unsigned int x = 0; x < f.w; x++) {
+				unsigned char* d = canvas.data() + (f.y + y) * pitch + (f.x + x) * bpp;
+				const unsigned char* s = f.px.data() + ((size_t) y * f.w + x) * bpp;
+				if (f.blend == 0) {
+					memcpy(d, s, bpp);
+				} else {
+					over(d, s, aw.bit_depth);
+				}
+			}
+		}
+		out.push_back(canvas);
+		
+		for (unsigned int y = 0; y < f.h; y++) {
+			unsigned char* d = canvas.data() + (f.y + y) * pitch + f.x * bpp;
+			if (dispose == 1) {
+				memset(d, 0, f.w * bpp);
+			} else if (dispose == 2) {
+				memcpy(d, saved.data() + (f.y + y) * pitch + f.x * bpp, f.w * bpp);
+			}
+		}
+	}
+	return out;
+}
+
+static apng_writer random_animation(unsigned int seed, unsigned char bit_depth, unsigned int n) {
+	rng r(seed);
+	apng_writer aw(17 + r.below(20), 9 + r.below(20), bit_depth);
+	aw.hidden_default = seed % 2 == 1;
+	for (unsigned int i = 0; i < n; i++) {
+		// Some frames cover the whole canvas, which makes keyframes.
+		aw.frames.push_back(random_frame(r, aw, (i == 0 && !aw.hidden_default) || r.below(6) == 0));
+	}
+	return aw;
+}
+
+static bool load(apng_writer& aw, img::apng& an, int* errcd) {
+	std::string fn = temp_path("anim.png");
+	write_file(fn, aw.encode());
+	bool ok = img::apng::load_apng((char*) fn.c_str(), an, 0, errcd) != NULL;
+	remove(fn.c_str());
+	return ok;
+}
+
+static bool same_canvas(const img::img* c, const std::vector<unsigned char>& ref) {
+	return c != NULL && c->bsize == ref.size() && memcmp(c->data, ref.data(), ref.size()) == 0;
+}
+
+// Playing the animation with next(), twice over, with every dispose and blend operation.
+static void test_play() {
+	unsigned char depths[] = {8, 16};
+	for (unsigned char depth : depths) {
+		for (unsigned int seed = 0; seed < 20; seed++) {
+			apng_writer aw = random_animation(seed, depth, 12);
+			aw.num_plays = seed;
+			std::vector<std::vector<unsigned char> > ref = reference(aw);
+			
+			img::apng an;
+			an.threads = 1 + seed % 4;
+			an.keep_frames = seed % 3 == 0;
+			int errcd;
+			CHECK(load(aw, an, &errcd));
+			CHECK_EQ(an.num_frames, 12);
+			CHECK_EQ(an.num_plays, seed);
+			CHECK_EQ(an.default_is_frame, !aw.hidden_default);
+			CHECK_EQ(an.canvas.bit_depth, depth);
+			CHECK_EQ(an.frames[3].delay_num, 4);
+			CHECK_EQ(an.frames[3].delay_den, 100);
+			
+			for (unsigned int i = 0; i < 24; i++) {
+				const img::img* c = an.next(&errcd);
+				CHECK_EQ(an.current, i % 12);
+				if (!same_canvas(c, ref[i % 12])) {
+					printf("frame %u of animation %u (%d bits) differs\n", i % 12, seed, depth);
+					test_failures++;
+				}
+			}
+		}
+	}
+}
+
+// Seeking to frames in any order gives the same canvas as playing up to them.
+static void test_seek() {
+	unsigned char depths[] = {8, 16};
+	for (unsigned char depth : depths) {
+		for (unsigned int seed = 100; seed < 110; seed++) {
+			apng_writer aw = random_animation(seed, depth, 20);
+			std::vector<std::vector<unsigned char> > ref = reference(aw);
+			
+			img::apng an;
+			an.threads = 3;
+			an.keep_frames = seed % 2 == 0;
+			int errcd;
+			CHECK(load(aw, an, &errcd));
+			
+			// Keyframes are frames which cover the whole canvas without blending, or follow one which covered it and was cleared.
+			for (unsigned int i = 1; i < 20; i++) {
+				const test_frame& f = aw.frames[i];
+				const test_frame& p = aw.frames[i - 1];
+				bool full = f.w == aw.width && f.h == aw.height;
+				bool pfull = p.w == aw.width && p.h == aw.height;
+				CHECK_EQ(an.frames[i].keyframe, (full && f.blend == 0 && f.dispose != 2) || (pfull && (p.dispose == 1 || (i == 1 && p.dispose == 2))));
+			}
+			CHECK(an.frames[0].keyframe);
+			
+			rng r(seed);
+			for (int k = 0; k < 40; k++) {
+				unsigned int n = r.below(20);
+				const img::img* c = an.seek(n, &errcd);
+				CHECK_EQ(an.current, n);
+				if (!same_canvas(c, ref[n])) {
+					printf("seek to frame %u of animation %u (%d bits) differs\n", n, seed, depth);
+					test_failures++;
+				}
+				
+				// Carry on playing from there.
+				if (k % 4 == 0 && n + 1 < 20) {
+					CHECK(same_canvas(an.next(&errcd), ref[n + 1]));
+				}
+			}
+			
+			CHECK(an.seek(20, &errcd) == NULL);
+			CHECK_EQ(errcd, -4);
+		}
+	}
+}
+
+// Frames decoded ahead by next() are freed once a seek leaves them behind, unless keep_frames is set.
+static void test_read_ahead() {
+	for (int keep = 0; keep < 2; keep++) {
+		apng_writer aw = random_animation(200, 8, 16);
+		std::vector<std::vector<unsigned char> > ref = reference(aw);
+		img::apng an;
+		an.threads = 4;
+		an.keep_frames = keep;
+		int errcd;
+		CHECK(load(aw, an, &errcd));
+		
+		CHECK(same_canvas(an.next(&errcd), ref[0]));
+		for (unsigned int i = 1; i < 4; i++) {
+			CHECK(an.frames[i].px != NULL);
+		}
+		
+		CHECK(same_canvas(an.seek(12, &errcd), ref[12]));
+		for (unsigned int i = 1; i < 4; i++) {
+			CHECK_EQ(an.frames[i].px != NULL, keep);
+		}
+		
+		// Stepping on keeps the frames which are still ahead. With keep_frames, frame 2 may already be decoded, in which case nothing is read ahead.
+		CHECK(same_canvas(an.seek(1, &errcd), ref[1]));
+		CHECK(same_canvas(an.next(&errcd), ref[2]));
+		if (!keep) {
+			CHECK(an.frames[3].px != NULL);
+			CHECK(an.frames[4].px != NULL);
+		}
+		CHECK(same_canvas(an.next(&errcd), ref[3]));
+		CHECK(same_canvas(an.next(&errcd), ref[4]));
+		
+		unsigned int decoded = 0;
+		for (unsigned int i = 0; i < 16; i++) {
+			decoded += an.frames[i].px != NULL;
+		}
+		if (!keep) {
+			CHECK(decoded <= 3);
+		}
+	}
+}
+
+// Number of threads in this process.
+static unsigned int thread_count() {
+	unsigned int n = 0;
+	FILE* fp = fopen("/proc/self/status", "r");
+	char line[256];
+	while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "Threads:", 8) == 0) n = atoi(line + 8);
+	}
+	if (fp != NULL) fclose(fp);
+	return n;
+}
+
+// decode_frames() starts its helper threads once and reuses them, and lowering threads leaves the extra ones idle.
+static void test_pool() {
+	apng_writer aw = random_animation(300, 8, 24);
+	std::vector<std::vector<unsigned char> > ref = reference(aw);
+	unsigned int before = thread_count();
+	{
+		img::apng an;
+		an.threads = 4;
+		int errcd;
+		CHECK(load(aw, an, &errcd));
+		CHECK_EQ(thread_count(), before);
+		
+		for (unsigned int i = 0; i < 24; i++) {
+			CHECK(same_canvas(an.next(&errcd), ref[i]));
+			CHECK_EQ(thread_count(), before + 3);
+		}
+		
+		an.threads = 1;
+		CHECK(same_canvas(an.seek(7, &errcd), ref[7]));
+		CHECK(an.decode_frames(8, 23, &errcd));
+		for (unsigned int i = 8; i < 24; i++) {
+			CHECK(an.frames[i].px != NULL);
+		}
+		CHECK_EQ(thread_count(), before + 3);
+	}
+	CHECK_EQ(thread_count(), before);
+}
+
+// Sequence numbers must count up from 0 across fcTL and fdAT chunks, and acTL must announce the right number of frames.
+static void test_sequence() {
+	apng_writer aw = random_animation(300, 8, 4);
+	img::apng good;
+	int errcd;
+	CHECK(load(aw, good, &errcd));
+	
+	// 4 frames make 4 fcTL chunks and 6 fdAT chunks, as the first frame's data is in IDAT chunks.
+	for (int i = 0; i < 10; i++) {
+		int offsets[] = {1, -1, 2};
+		for (int off : offsets) {
+			if (i + off < 0) continue;
+			aw.bad_seq = i;
+			aw.seq_offset = off;
+			img::apng an;
+			CHECK(!load(aw, an, &errcd));
+			CHECK_EQ(errcd, -5);
+		}
+	}
+	aw.bad_seq = -1;
+	
+	// A frame missing from the file.
+	std::vector<unsigned char> f = aw.encode();
+	f[8 + 25 + 8 + 3] = 5;
+	unsigned int c = crc32(f.data() + 8 + 25 + 4, 12);
+	for (int k = 0; k < 4; k++) {
+		f[8 + 25 + 8 + 8 + k] = c >> (24 - 8 * k);
+	}
+	std::string fn = temp_path("seq.png");
+	CHECK(write_file(fn, f));
+	img::apng an;
+	CHECK(img::apng::load_apng((char*) fn.c_str(), an, 0, &errcd) == NULL);
+	CHECK_EQ(errcd, -3);
+	remove(fn.c_str());
+}
+
+// The SSE2 blend of four pixels at a time gives exactly the results of the integer formula, for every pair of alpha values.
+static void test_blend() {
+	rng r(7);
+	std::vector<unsigned char> s(256 * 4);
+	std::vector<unsigned char> d(256 * 4);
+	std::vector<unsigned char> ref(256 * 4);
+	unsigned int mismatches = 0;
+	
+	for (unsigned int a2 = 0; a2 < 256; a2++) {
+		for (unsigned int rep = 0; rep < 4; rep++) {
+			for (unsigned int i = 0; i < 256; i++) {
+				for (int c = 0; c < 3; c++) {
+					s[4*i + c] = r.below(256);
+					d[4*i + c] = r.below(256);
+				}
+				// Every source alpha against this destination alpha, in groups which are partly opaque or transparent.
+				s[4*i + 3] = rep == 0 ? i : rep == 1 ? (i % 4 == 0 ? 255 : i) : rep == 2 ? (i % 4 == 0 ? 0 : i) : r.below(256);
+				d[4*i + 3] = a2;
+			}
+			
+			ref = d;
+			for (unsigned int i = 0; i < 256; i++) {
+				over(ref.data() + 4*i, s.data() + 4*i, 8);
+			}
+			
+			// Odd lengths leave pixels for the scalar tail.
+			size_t n = 256 - rep;
+			img::apng_over_row(d.data(), s.data(), n, 8);
+			mismatches += memcmp(d.data(), ref.data(), 4 * n) != 0;
+		}
+	}
+	CHECK_EQ(mismatches, 0);
+	
+	// 16 bit rows.
+	std::vector<unsigned char> s16 = pattern(8 * 100, 1);
+	std::vector<unsigned char> d16 = pattern(8 * 100, 2);
+	for (int i = 0; i < 100; i += 3) {
+		s16[8*i + 6] = s16[8*i + 7] = i % 2 ? 0xFF : 0;
+	}
+	std::vector<unsigned char> ref16 = d16;
+	for (int i = 0; i < 100; i++) {
+		over(ref16.data() + 8*i, s16.data() + 8*i, 16);
+	}
+	img::apng_over_row(d16.data(), s16.data(), 100, 16);
+	CHECK(d16 == ref16);
+}
+
+int main() {
+	test_blend();
+	test_play();
+	test_seek();
+	test_read_ahead();
+	test_pool();
+	test_sequence();
+	
+	return TEST_RESULT();
+}
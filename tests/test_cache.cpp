@@ -0,0 +1,215 @@
+// Loads PNG files written by testing.hpp through img::cache, and checks its counters, eviction order and budget.
+
+#include <thread>
+
+#include "../img.hpp"
+#include "../cache.hpp"
+#include "testing.hpp"
+
+using namespace testing;
+
+// An 8 bit grayscale image of w x h pixels, which the cache counts as w * h bytes.
+static std::vector<unsigned char> gray(unsigned int w, unsigned int h, unsigned int seed) {
+	png_writer pw(w, h, 0, 8);
+	return pw.encode(random_pixels(pw, seed));
+}
+
+static std::shared_ptr<const img::img> load(img::cache& c, const std::string& fn, int* errcd) {
+	return c.load((char*) fn.c_str(), 0, errcd);
+}
+
+static void test_hits() {
+	std::string fn = temp_path("hits.png");
+	CHECK(write_file(fn, gray(10, 10, 1)));
+	img::cache c(1000, img::png_opts());
+	int errcd;
+	
+	std::shared_ptr<const img::img> a = load(c, fn, &errcd);
+	CHECK(a);
+	CHECK_EQ(errcd, 0);
+	std::shared_ptr<const img::img> b = load(c, fn, &errcd);
+	CHECK(a == b);
+	
+	img::cache_stats s = c.stats();
+	CHECK_EQ(s.misses, 1);
+	CHECK_EQ(s.hits, 1);
+	CHECK_EQ(s.waits, 0);
+	CHECK_EQ(s.entries, 1);
+	CHECK_EQ(s.bytes, 100);
+	
+	// A rewritten file is decoded again, and replaces the old image.
+	CHECK(write_file(fn, gray(10, 12, 2)));
+	std::shared_ptr<const img::img> d = load(c, fn, &errcd);
+	CHECK(d && d != a && d->height == 12);
+	s = c.stats();
+	CHECK_EQ(s.misses, 2);
+	CHECK_EQ(s.entries, 1);
+	CHECK_EQ(s.bytes, 120);
+	
+	// Images handed out stay valid after they leave the cache.
+	c.clear();
+	CHECK_EQ(c.stats().entries, 0);
+	CHECK_EQ(c.stats().bytes, 0);
+	CHECK(a->width == 10 && a->data != NULL);
+	
+	// Failures are not cached.
+	std::vector<unsigned char> f = gray(10, 10, 3);
+	f[f.size() - 16] ^= 0xFF;
+	CHECK(write_file(fn, f));
+	CHECK(!load(c, fn, &errcd));
+	CHECK(errcd != 0);
+	CHECK(!load(c, fn, &errcd));
+	s = c.stats();
+	CHECK_EQ(s.misses, 4);
+	CHECK_EQ(s.entries, 0);
+	
+	remove(fn.c_str());
+	CHECK(!load(c, fn, &errcd));
+	CHECK_EQ(errcd, -1);
+}
+
+// With content hashes as versions, rewriting a file with the same contents keeps the cached image.
+static void test_hash_keys() {
+	std::string fn = temp_path("hash.png");
+	std::vector<unsigned char> f = gray(10, 10, 4);
+	CHECK(write_file(fn, f));
+	img::cache c(1000, img::png_opts());
+	c.hash_keys = true;
+	int errcd;
+	
+	std::shared_ptr<const img::img> a = load(c, fn, &errcd);
+	CHECK(write_file(fn, f));
+	CHECK(load(c, fn, &errcd) == a);
+	
+	// Same size, different pixels.
+	CHECK(write_file(fn, gray(10, 10, 5)));
+	std::shared_ptr<const img::img> b = load(c, fn, &errcd);
+	CHECK(b && b != a);
+	CHECK_EQ(c.stats().misses, 2);
+	CHECK_EQ(c.stats().hits, 1);
+	
+	remove(fn.c_str());
+}
+
+// The least recently used image goes first, and images never exceed the budget.
+static void test_eviction() {
+	std::string fn[4];
+	for (int i = 0; i < 4; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "lru%d.png", i);
+		fn[i] = temp_path(name);
+		CHECK(write_file(fn[i], gray(10, 10, 10 + i)));
+	}
+	img::cache c(250, img::png_opts());
+	int errcd;
+	
+	std::shared_ptr<const img::img> first = load(c, fn[0], &errcd);
+	load(c, fn[1], &errcd);
+	CHECK(load(c, fn[0], &errcd) == first);
+	
+	// 1 is now the least recently used.
+	load(c, fn[2], &errcd);
+	img::cache_stats s = c.stats();
+	CHECK_EQ(s.evictions, 1);
+	CHECK_EQ(s.entries, 2);
+	CHECK_EQ(s.bytes, 200);
+	
+	unsigned long long misses = s.misses;
+	CHECK(load(c, fn[0], &errcd) == first);
+	load(c, fn[2], &errcd);
+	CHECK_EQ(c.stats().misses, misses);
+	
+	// Now 0 is the least recently used, and goes when 1 comes back.
+	load(c, fn[1], &errcd);
+	s = c.stats();
+	CHECK_EQ(s.misses, misses + 1);
+	CHECK_EQ(s.evictions, 2);
+	load(c, fn[2], &errcd);
+	load(c, fn[0], &errcd);
+	CHECK_EQ(c.stats().misses, misses + 2);
+	
+	// Shrinking the budget evicts down to it.
+	c.set_budget(150);
+	s = c.stats();
+	CHECK_EQ(s.entries, 1);
+	CHECK_EQ(s.bytes, 100);
+	CHECK_EQ(s.evictions, 4);
+	
+	// An image larger than the budget is returned, but not cached.
+	std::string big = temp_path("big.png");
+	CHECK(write_file(big, gray(20, 10, 20)));
+	std::shared_ptr<const img::img> b = load(c, big, &errcd);
+	CHECK(b && b->width == 20);
+	s = c.stats();
+	CHECK_EQ(s.entries, 1);
+	CHECK_EQ(s.bytes, 100);
+	CHECK(load(c, big, &errcd) != b);
+	CHECK_EQ(c.stats().misses, s.misses + 1);
+	
+	c.set_budget(0);
+	CHECK_EQ(c.stats().entries, 0);
+	CHECK_EQ(c.stats().bytes, 0);
+	
+	remove(big.c_str());
+	for (int i = 0; i < 4; i++) {
+		remove(fn[i].c_str());
+	}
+}
+
+// Threads missing on the same file at once share a single decode.
+static void test_single_flight() {
+	std::string fn = temp_path("flight.png");
+	png_writer pw(1500, 1000, 6, 16);
+	pw.mode = ZLIB_STORED;
+	CHECK(pw.save(fn, random_pixels(pw, 30)));
+	img::cache c((size_t) 1 << 30, img::png_opts());
+	
+	const int n = 8;
+	std::shared_ptr<const img::img> got[n];
+	int errcd[n];
+	std::vector<std::thread> threads;
+	for (int i = 0; i < n; i++) {
+		threads.emplace_back([&, i]() { got[i] = load(c, fn, &errcd[i]); });
+	}
+	for (std::thread& t : threads) {
+		t.join();
+	}
+	
+	for (int i = 0; i < n; i++) {
+		CHECK(got[i] && got[i] == got[0]);
+		CHECK_EQ(errcd[i], 0);
+	}
+	img::cache_stats s = c.stats();
+	CHECK_EQ(s.misses, 1);
+	CHECK_EQ(s.hits, n - 1);
+	CHECK(s.waits <= s.hits);
+	CHECK_EQ(s.entries, 1);
+	
+	// Threads waiting on a decode which fails get its error.
+	std::vector<unsigned char> f = pw.encode(random_pixels(pw, 31));
+	f[f.size() / 2] ^= 0xFF;
+	CHECK(write_file(fn, f));
+	threads.clear();
+	for (int i = 0; i < n; i++) {
+		threads.emplace_back([&, i]() { got[i] = load(c, fn, &errcd[i]); });
+	}
+	for (std::thread& t : threads) {
+		t.join();
+	}
+	for (int i = 0; i < n; i++) {
+		CHECK(!got[i]);
+		CHECK(errcd[i] != 0);
+	}
+	CHECK_EQ(c.stats().entries, 0);
+	
+	remove(fn.c_str());
+}
+
+int main() {
+	test_hits();
+	test_hash_keys();
+	test_eviction();
+	test_single_flight();
+	
+	return TEST_RESULT();
+}
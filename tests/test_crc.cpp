@@ -0,0 +1,124 @@
+// Decodes PNG files with corrupted CRCs in every png_crc_mode, and checks which png_trust levels accept them.
+
+#include "../img.hpp"
+#include "testing.hpp"
+
+using namespace testing;
+
+static const img::png_crc_mode modes[] = {img::PNG_CRC_SERIAL, img::PNG_CRC_SLICED, img::PNG_CRC_THREAD};
+static const char* mode_names[] = {"serial", "sliced", "thread"};
+
+static bool decode(const std::string& fn, img::img& im, img::png_crc_mode mode, img::png_trust trust, int* errcd) {
+	img::png_opts opts;
+	opts.crc_mode = mode;
+	opts.trust = trust;
+	// A verbosity of -1 also keeps the contents of tEXt chunks quiet.
+	return img::img::load_png((char*) fn.c_str(), im, opts, -1, errcd) != NULL;
+}
+
+static bool same_pixels(const img::img& im, const std::vector<unsigned char>& px) {
+	return im.data != NULL && im.bsize == px.size() && memcmp(im.data, px.data(), px.size()) == 0;
+}
+
+// The file with one bit of the CRC of IDAT chunk k flipped. The chunk data itself is left intact.
+static std::vector<unsigned char> bad_crc(const png_writer& pw, const std::vector<unsigned char>& f, size_t k) {
+	std::vector<unsigned char> g = f;
+	size_t at = pw.idat_offsets[k];
+	size_t len = (size_t) f[at] << 24 | f[at+1] << 16 | f[at+2] << 8 | f[at+3];
+	g[at + 8 + len + 1] ^= 0x10;
+	return g;
+}
+
+// Chunks larger than IMG_CRC_SLICE, so that sliced mode alternates between checking and inflating within a chunk, and chunks smaller than it.
+static void test_idat() {
+	size_t idat_sizes[] = {200000, 5000};
+	std::string fn = temp_path("crc.png");
+	
+	for (size_t idat_size : idat_sizes) {
+		png_writer pw(300, 250, 6, 8);
+		pw.mode = ZLIB_STORED;
+		pw.idat_size = idat_size;
+		std::vector<unsigned char> px = random_pixels(pw, idat_size);
+		std::vector<unsigned char> f = pw.encode(px);
+		size_t chunks = pw.idat_offsets.size();
+		CHECK(chunks > 1);
+		
+		for (int m = 0; m < 3; m++) {
+			CHECK(write_file(fn, f));
+			img::img good;
+			int errcd;
+			CHECK(decode(fn, good, modes[m], img::PNG_TRUST_NONE, &errcd));
+			CHECK(same_pixels(good, px));
+			
+			// The first, a middle and the last chunk.
+			size_t which[] = {0, chunks / 2, chunks - 1};
+			for (size_t k : which) {
+				CHECK(write_file(fn, bad_crc(pw, f, k)));
+				
+				img::img im;
+				if (decode(fn, im, modes[m], img::PNG_TRUST_NONE, &errcd) || errcd != -5) {
+					printf("%s: corrupted CRC of IDAT chunk %zu of %zu (%zu bytes each) gave %d instead of -5\n", mode_names[m], k, chunks, idat_size, errcd);
+					test_failures++;
+				}
+				
+				// IDAT is critical, so trusting only ancillary chunks still checks it.
+				img::img im2;
+				CHECK(!decode(fn, im2, modes[m], img::PNG_TRUST_ANCILLARY, &errcd));
+				CHECK_EQ(errcd, -5);
+				
+				img::img im3;
+				CHECK(decode(fn, im3, modes[m], img::PNG_TRUST_ALL, &errcd));
+				CHECK_EQ(errcd, 0);
+				CHECK(same_pixels(im3, px));
+			}
+		}
+	}
+	remove(fn.c_str());
+}
+
+// A corrupted ancillary chunk is skipped with a warning unless the trust level skips its check.
+static void test_ancillary() {
+	std::string fn = temp_path("anc.png");
+	png_writer pw(20, 20, 2, 8);
+	pw.text = std::string("Comment\0A note about the image", 30);
+	std::vector<unsigned char> px = random_pixels(pw, 4);
+	std::vector<unsigned char> f = pw.encode(px);
+	
+	// tEXt comes right before the first IDAT chunk, its CRC right before that.
+	f[pw.idat_offsets[0] - 1] ^= 1;
+	CHECK(write_file(fn, f));
+	
+	img::png_trust trusts[] = {img::PNG_TRUST_NONE, img::PNG_TRUST_ANCILLARY, img::PNG_TRUST_ALL};
+	for (int m = 0; m < 3; m++) {
+		for (img::png_trust t : trusts) {
+			img::img im;
+			int errcd;
+			CHECK(decode(fn, im, modes[m], t, &errcd));
+			CHECK_EQ(errcd, 0);
+			CHECK(same_pixels(im, px));
+		}
+	}
+	
+	// The same for the CRC of IHDR, which is critical.
+	f = pw.encode(px);
+	f[8 + 8 + 13] ^= 1;
+	CHECK(write_file(fn, f));
+	for (int m = 0; m < 3; m++) {
+		img::img im;
+		int errcd;
+		CHECK(!decode(fn, im, modes[m], img::PNG_TRUST_ANCILLARY, &errcd));
+		CHECK_EQ(errcd, -5);
+		
+		img::img im2;
+		CHECK(decode(fn, im2, modes[m], img::PNG_TRUST_ALL, &errcd));
+		CHECK(same_pixels(im2, px));
+	}
+	remove(fn.c_str());
+}
+
+int main() {
+	test_idat();
+	test_ancillary();
+	
+	return TEST_RESULT();
+}
@@ -0,0 +1,180 @@
+// Decodes rectangles of PNG files written by testing.hpp and checks them against the same rectangles cut out of the source pixels.
+
+#include "../img.hpp"
+#include "testing.hpp"
+
+using namespace testing;
+
+static bool same_pixels(const img::img& im, const std::vector<unsigned char>& px) {
+	return im.data != NULL && im.bsize == px.size() && memcmp(im.data, px.data(), px.size()) == 0;
+}
+
+// Decode the rectangle with and without a scale, and compare both to the reference.
+static void check_crop(const std::string& fn, const png_writer& pw, const std::vector<unsigned char>& px, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned int scale, bool early_passes = false) {
+	img::img im;
+	img::png_opts opts;
+	opts.crop_x = x;
+	opts.crop_y = y;
+	opts.crop_w = w;
+	opts.crop_h = h;
+	opts.scale = scale;
+	opts.early_passes = early_passes;
+	int errcd;
+	
+	bool ok = img::img::load_png((char*) fn.c_str(), im, opts, 0, &errcd) != NULL;
+	std::vector<unsigned char> ref = crop_pixels(pw, px, x, y, w, h);
+	if (scale > 1) {
+		png_writer cw(w, h, pw.color_type, pw.bit_depth, pw.interlaced);
+		ref = box_reference(cw, ref, scale, early_passes ? adam7_grid(pw, scale, x, y) : 1);
+	}
+	
+	if (!ok || im.width != (w + scale - 1) / scale || im.height != (h + scale - 1) / scale || !same_pixels(im, ref)) {
+		printf("crop %u,%u %ux%u at scale %u (early passes %d) of a %ux%u image (color type %d, depth %d, interlaced %d) differs, errcd %d\n", x, y, w, h, scale, early_passes, pw.width, pw.height, pw.color_type, pw.bit_depth, pw.interlaced, errcd);
+		test_failures++;
+	}
+}
+
+// Rectangles touching every edge and corner, single rows and columns, and the whole image.
+static void test_edges() {
+	unsigned char formats[][3] = {{0, 1, 0}, {0, 2, 0}, {3, 4, 0}, {0, 8, 0}, {2, 16, 0}, {6, 8, 0}, {0, 8, 1}, {2, 8, 1}, {4, 16, 1}, {6, 16, 1}};
+	std::string fn = temp_path("edges.png");
+	unsigned int W = 29;
+	unsigned int H = 23;
+	unsigned int seed = 0;
+	
+	unsigned int rects[][4] = {
+		{0, 0, W, H}, {0, 0, 1, 1}, {W - 1, 0, 1, 1}, {0, H - 1, 1, 1}, {W - 1, H - 1, 1, 1},
+		{0, 0, W, 1}, {0, H - 1, W, 1}, {0, 0, 1, H}, {W - 1, 0, 1, H},
+		{3, 5, W - 3, H - 5}, {1, 1, W - 2, H - 2}, {5, 2, 9, 17}, {7, 7, 3, 3}, {8, 8, 16, 8}, {16, 0, 13, 23}
+	};
+	
+	for (auto& f : formats) {
+		png_writer pw(W, H, f[0], f[1], f[2]);
+		pw.idat_size = 37;
+		if (f[0] == 3) {
+			pw.palette = pattern(3 * 16, seed);
+		}
+		std::vector<unsigned char> px = random_pixels(pw, seed++, 16);
+		CHECK(pw.save(fn, px));
+		
+		for (auto& r : rects) {
+			check_crop(fn, pw, px, r[0], r[1], r[2], r[3], 1);
+		}
+	}
+	remove(fn.c_str());
+}
+
+// Sub-byte pixels are shifted so that each cropped row starts on a byte boundary, for every offset within a byte.
+static void test_sub_byte() {
+	unsigned char depths[] = {1, 2, 4};
+	std::string fn = temp_path("subbyte.png");
+	
+	for (unsigned char d : depths) {
+		png_writer pw(37, 9, 0, d);
+		std::vector<unsigned char> px = random_pixels(pw, d);
+		CHECK(pw.save(fn, px));
+		
+		for (unsigned int x = 0; x < 9; x++) {
+			unsigned int widths[] = {1, 3, 8, 13, 37 - x - 1};
+			for (unsigned int w : widths) {
+				if (w == 0 || x + w > 37) continue;
+				check_crop(fn, pw, px, x, 2, w, 5, 1);
+			}
+		}
+	}
+	remove(fn.c_str());
+}
+
+// Cropping and downscaling together, with Adam-7 regions on and off the 8, 4 and 2 pixel grids used by png_opts::early_passes.
+static void test_scaled() {
+	std::string fn = temp_path("scaled.png");
+	unsigned int scales[] = {2, 3, 4, 8};
+	unsigned int rects[][4] = {{0, 0, 40, 33}, {8, 8, 24, 16}, {4, 4, 30, 20}, {2, 6, 17, 19}, {3, 1, 20, 20}, {39, 32, 1, 1}};
+	
+	for (int interlaced = 0; interlaced < 2; interlaced++) {
+		png_writer pw(40, 33, 2, 8, interlaced);
+		std::vector<unsigned char> px = random_pixels(pw, 11 + interlaced);
+		CHECK(pw.save(fn, px));
+		
+		for (auto& r : rects) {
+			for (unsigned int scale : scales) {
+				check_crop(fn, pw, px, r[0], r[1], r[2], r[3], scale);
+				check_crop(fn, pw, px, r[0], r[1], r[2], r[3], scale, true);
+			}
+		}
+	}
+	remove(fn.c_str());
+}
+
+// A rectangle near the top of an image stored in one large IDAT chunk. Inflating stops within the chunk once the rectangle is done, so a broken Adler-32 at the end of the chunk is never reached.
+static void test_single_chunk() {
+	std::string fn = temp_path("single.png");
+	png_writer pw(1000, 400, 2, 8);
+	pw.mode = ZLIB_STORED;
+	pw.idat_size = (size_t) 1 << 30;
+	std::vector<unsigned char> px = random_pixels(pw, 21);
+	std::vector<unsigned char> f = pw.encode(px);
+	CHECK_EQ(pw.idat_offsets.size(), 1);
+	
+	size_t at = pw.idat_offsets[0];
+	size_t len = (size_t) f[at] << 24 | f[at+1] << 16 | f[at+2] << 8 | f[at+3];
+	f[at + 8 + len - 1] ^= 0xFF;
+	CHECK(write_file(fn, f));
+	
+	img::png_opts opts;
+	// The CRC of the chunk now fails as well, it is skipped so that the Adler-32 is what would fail.
+	opts.trust = img::PNG_TRUST_ALL;
+	int errcd;
+	img::img whole;
+	CHECK(img::img::load_png((char*) fn.c_str(), whole, opts, 0, &errcd) == NULL);
+	CHECK_EQ(errcd, -5);
+	
+	opts.crop_x = 100;
+	opts.crop_y = 3;
+	opts.crop_w = 64;
+	opts.crop_h = 8;
+	img::img im;
+	CHECK(img::img::load_png((char*) fn.c_str(), im, opts, 0, &errcd) != NULL);
+	CHECK_EQ(errcd, 0);
+	CHECK(same_pixels(im, crop_pixels(pw, px, 100, 3, 64, 8)));
+	
+	remove(fn.c_str());
+}
+
+static void test_invalid() {
+	std::string fn = temp_path("invalid.png");
+	png_writer pw(20, 10, 0, 8);
+	std::vector<unsigned char> px = random_pixels(pw, 1);
+	CHECK(pw.save(fn, px));
+	
+	unsigned int rects[][4] = {{20, 0, 1, 1}, {0, 10, 1, 1}, {0, 0, 21, 1}, {0, 0, 1, 11}, {19, 0, 2, 1}, {5, 5, 0xFFFFFFFF, 1}};
+	for (auto& r : rects) {
+		img::img im;
+		int errcd;
+		CHECK(img::img::load_png((char*) fn.c_str(), im, r[0], r[1], r[2], r[3], 0, &errcd) == NULL);
+		CHECK_EQ(errcd, -4);
+	}
+	
+	// A rectangle without area means the whole image.
+	img::img im;
+	int errcd;
+	CHECK(img::img::load_png((char*) fn.c_str(), im, 3, 3, 0, 5, 0, &errcd) != NULL);
+	CHECK(same_pixels(im, px));
+	
+	// The overload taking a rectangle directly.
+	img::img im2;
+	CHECK(img::img::load_png((char*) fn.c_str(), im2, 4, 2, 7, 3, 0, &errcd) != NULL);
+	CHECK(same_pixels(im2, crop_pixels(pw, px, 4, 2, 7, 3)));
+	
+	remove(fn.c_str());
+}
+
+int main() {
+	test_edges();
+	test_sub_byte();
+	test_scaled();
+	test_single_chunk();
+	test_invalid();
+	
+	return TEST_RESULT();
+}
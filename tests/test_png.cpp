@@ -0,0 +1,383 @@
+// Decodes PNG files written by testing.hpp at full size and downscaled, and checks the pixels against the ones they were written from.
+
+#include <sys/mman.h>
+
+#include "../img.hpp"
+#include "testing.hpp"
+
+using namespace testing;
+
+#ifdef __SANITIZE_ADDRESS__
+// Allocations which cannot be satisfied return NULL, as they do without AddressSanitizer, rather than ending the test.
+extern "C" const char* __asan_default_options() {
+	return "allocator_may_return_null=1";
+}
+#endif
+
+static bool decode(const std::string& fn, img::img& im, const img::png_opts& opts, int* errcd) {
+	return img::img::load_png((char*) fn.c_str(), im, opts, 0, errcd) != NULL;
+}
+
+static bool same_pixels(const img::img& im, const std::vector<unsigned char>& px) {
+	return im.data != NULL && im.bsize == px.size() && memcmp(im.data, px.data(), px.size()) == 0;
+}
+
+// Every color type and bit depth, with and without Adam-7, split into IDAT chunks of various sizes.
+static void test_full_size() {
+	unsigned char formats[][2] = {{0, 1}, {0, 2}, {0, 4}, {0, 8}, {0, 16}, {2, 8}, {2, 16}, {3, 1}, {3, 2}, {3, 4}, {3, 8}, {4, 8}, {4, 16}, {6, 8}, {6, 16}};
+	unsigned int sizes[][2] = {{1, 1}, {3, 5}, {17, 13}, {64, 33}};
+	size_t idat_sizes[] = {1, 7, 1000};
+	std::string fn = temp_path("full.png");
+	unsigned int seed = 0;
+	
+	for (auto& f : formats) {
+		for (int interlaced = 0; interlaced < 2; interlaced++) {
+			// Adam-7 is only supported for whole-byte samples.
+			if (interlaced && f[1] < 8) continue;
+			
+			for (auto& s : sizes) {
+				png_writer pw(s[0], s[1], f[0], f[1], interlaced);
+				pw.idat_size = idat_sizes[seed % 3];
+				pw.mode = seed % 2 ? ZLIB_FIXED : ZLIB_STORED;
+				if (f[0] == 3) {
+					pw.palette = pattern(3 * 16, seed);
+				}
+				std::vector<unsigned char> px = random_pixels(pw, seed++, 16);
+				CHECK(pw.save(fn, px));
+				
+				img::img im;
+				img::png_opts opts;
+				int errcd;
+				CHECK(decode(fn, im, opts, &errcd));
+				CHECK_EQ(errcd, 0);
+				CHECK_EQ(im.width, s[0]);
+				CHECK_EQ(im.height, s[1]);
+				CHECK_EQ(im.bit_depth, f[1]);
+				CHECK_EQ(im.pitch, pw.pitch());
+				CHECK(same_pixels(im, px));
+				if (f[0] == 3) {
+					CHECK_EQ(im.palette_length, 16);
+					CHECK(im.palette != NULL && memcmp(im.palette, pw.palette.data(), 48) == 0);
+				}
+			}
+		}
+	}
+	remove(fn.c_str());
+}
+
+static void test_scale() {
+	unsigned char formats[][2] = {{0, 8}, {0, 16}, {2, 8}, {4, 16}, {6, 8}};
+	unsigned int scales[] = {2, 3, 4, 5, 8, 16, 40};
+	std::string fn = temp_path("scale.png");
+	unsigned int seed = 100;
+	
+	for (auto& f : formats) {
+		for (int interlaced = 0; interlaced < 2; interlaced++) {
+			png_writer pw(37, 29, f[0], f[1], interlaced);
+			std::vector<unsigned char> px = random_pixels(pw, seed++);
+			CHECK(pw.save(fn, px));
+			
+			for (unsigned int scale : scales) {
+				// Every pixel is averaged unless early_passes is set.
+				for (int early = 0; early < 2; early++) {
+					img::img im;
+					img::png_opts opts;
+					opts.scale = scale;
+					opts.early_passes = early;
+					int errcd;
+					CHECK(decode(fn, im, opts, &errcd));
+					CHECK_EQ(im.width, (37 + scale - 1) / scale);
+					CHECK_EQ(im.height, (29 + scale - 1) / scale);
+					if (!same_pixels(im, box_reference(pw, px, scale, early ? adam7_grid(pw, scale) : 1))) {
+						printf("scale %u of color type %d, depth %d, interlaced %d, early passes %d differs\n", scale, f[0], f[1], interlaced, early);
+						test_failures++;
+					}
+				}
+			}
+		}
+	}
+	
+	// Downscaled Adam-7 images decoded into a file are only written once the averages are known. A scale of 257 needs 64 bit sums for 16 bit samples.
+	png_writer pi(50, 41, 6, 16, true);
+	std::vector<unsigned char> pxi = random_pixels(pi, 5);
+	CHECK(pi.save(fn, pxi));
+	std::string out = temp_path("scale.raw");
+	unsigned int file_scales[] = {3, 8, 12, 257};
+	for (unsigned int scale : file_scales) {
+		for (int early = 0; early < 2; early++) {
+			img::img im;
+			img::png_opts opts;
+			opts.scale = scale;
+			opts.early_passes = early;
+			opts.out_fn = (char*) out.c_str();
+			int errcd;
+			CHECK(decode(fn, im, opts, &errcd));
+			CHECK(same_pixels(im, box_reference(pi, pxi, scale, early ? adam7_grid(pi, scale) : 1)));
+		}
+	}
+	remove(out.c_str());
+	
+	// Palette and sub-byte samples cannot be averaged.
+	png_writer pw(8, 8, 3, 8);
+	pw.palette = pattern(12, 1);
+	CHECK(pw.save(fn, random_pixels(pw, 1, 4)));
+	img::img im;
+	img::png_opts opts;
+	opts.scale = 2;
+	int errcd;
+	CHECK(!decode(fn, im, opts, &errcd));
+	CHECK_EQ(errcd, -4);
+	
+	remove(fn.c_str());
+}
+
+// max_width and max_height pick the smallest scale at which the image fits.
+static void test_max_size() {
+	std::string fn = temp_path("max.png");
+	png_writer pw(100, 60, 2, 8);
+	std::vector<unsigned char> px = random_pixels(pw, 7);
+	CHECK(pw.save(fn, px));
+	
+	struct {
+		unsigned int max_w, max_h, scale, w, h;
+	} cases[] = {{30, 0, 4, 25, 15}, {0, 7, 9, 12, 7}, {30, 7, 9, 12, 7}, {200, 200, 1, 100, 60}, {100, 60, 1, 100, 60}, {99, 0, 2, 50, 30}, {1, 1, 100, 1, 1}};
+	
+	for (auto& c : cases) {
+		img::img im;
+		img::png_opts opts;
+		opts.max_width = c.max_w;
+		opts.max_height = c.max_h;
+		int errcd;
+		CHECK(decode(fn, im, opts, &errcd));
+		CHECK_EQ(im.width, c.w);
+		CHECK_EQ(im.height, c.h);
+		CHECK(same_pixels(im, c.scale == 1 ? px : box_reference(pw, px, c.scale, 1)));
+	}
+	remove(fn.c_str());
+}
+
+// Decoding into a file given by out_fn, and into a mapping given by out_map.
+static void test_output() {
+	std::string fn = temp_path("output.png");
+	std::string out = temp_path("output.raw");
+	
+	// More than IMG_WRITE_BEHIND_SIZE bytes, so finished rows are written back and dropped from the mapping while the rest is decoded.
+	png_writer pw(3000, 1500, 6, 8);
+	pw.mode = ZLIB_STORED;
+	pw.idat_size = 100000;
+	std::vector<unsigned char> px = random_pixels(pw, 12);
+	CHECK(px.size() > 0x1000000);
+	CHECK(pw.save(fn, px));
+	
+	int errcd;
+	{
+		img::img im;
+		img::png_opts opts;
+		opts.out_fn = (char*) out.c_str();
+		CHECK(decode(fn, im, opts, &errcd));
+		CHECK_EQ(im.data_mode, 1);
+		CHECK(same_pixels(im, px));
+	}
+	CHECK(read_file(out) == px);
+	
+	// A MAP_SHARED mapping of a file, which has to start on a page boundary as finished rows are passed to msync().
+	png_writer small(300, 200, 2, 16);
+	std::vector<unsigned char> spx = random_pixels(small, 13);
+	CHECK(small.save(fn, spx));
+	
+	size_t len = spx.size() + 100;
+	CHECK(write_file(out, std::vector<unsigned char>(len, 0xAA)));
+	FILE* fp = fopen(out.c_str(), "r+b");
+	CHECK(fp != NULL);
+	void* map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+	CHECK(map != MAP_FAILED);
+	{
+		img::img im;
+		img::png_opts opts;
+		opts.out_map = (unsigned char*) map;
+		opts.out_map_len = len;
+		CHECK(decode(fn, im, opts, &errcd));
+		CHECK(im.data == map);
+		CHECK_EQ(im.data_mode, 2);
+		CHECK(same_pixels(im, spx));
+		
+		// Too short by one byte. im.bsize tells how large the mapping has to be.
+		img::img im2;
+		opts.out_map_len = spx.size() - 1;
+		CHECK(!decode(fn, im2, opts, &errcd));
+		CHECK_EQ(errcd, -4);
+		CHECK_EQ(im2.bsize, spx.size());
+	}
+	// The image leaves the mapping alone, and the bytes after the image are untouched.
+	CHECK(munmap(map, len) == 0);
+	fclose(fp);
+	std::vector<unsigned char> d = read_file(out);
+	CHECK(d.size() == len && memcmp(d.data(), spx.data(), spx.size()) == 0 && d[spx.size()] == 0xAA && d[len - 1] == 0xAA);
+	
+	remove(out.c_str());
+	remove(fn.c_str());
+}
+
+// A real file, compressed by zlib with dynamic Huffman codes. The hash is that of its pixels as decoded by Python's zlib.
+static void test_fish() {
+	img::img im;
+	img::png_opts opts;
+	int errcd;
+	CHECK(decode(repo_path("fish.png"), im, opts, &errcd));
+	CHECK_EQ(errcd, 0);
+	CHECK_EQ(im.width, 915);
+	CHECK_EQ(im.height, 610);
+	CHECK_EQ(im.bpp, 3);
+	CHECK(im.data != NULL && fnv1a(im.data, im.bsize) == 0x331195c7cf8f2cfbULL);
+}
+
+static void test_errors() {
+	std::string fn = temp_path("err.png");
+	png_writer pw(16, 16, 0, 8);
+	std::vector<unsigned char> px = random_pixels(pw, 3);
+	std::vector<unsigned char> f = pw.encode(px);
+	img::img im;
+	img::png_opts opts;
+	int errcd;
+	
+	CHECK(!decode(temp_path("missing.png"), im, opts, &errcd));
+	CHECK_EQ(errcd, -1);
+	
+	// Image data cut off before the last scanline, by dropping the IDAT chunks after the first.
+	png_writer small(16, 16, 0, 8);
+	small.idat_size = 50;
+	small.mode = ZLIB_STORED;
+	std::vector<unsigned char> g = small.encode(px);
+	std::vector<unsigned char> cut(g.begin(), g.begin() + small.idat_offsets[1]);
+	cut.insert(cut.end(), g.end() - 12, g.end());
+	CHECK(write_file(fn, cut));
+	img::img im2;
+	CHECK(!decode(fn, im2, opts, &errcd));
+	CHECK_EQ(errcd, -3);
+	
+	// Invalid filter type.
+	pw.filter = 5;
+	CHECK(pw.save(fn, px));
+	img::img im3;
+	CHECK(!decode(fn, im3, opts, &errcd));
+	CHECK_EQ(errcd, -5);
+	
+	remove(fn.c_str());
+}
+
+// Bytes 0-7 of the IHDR data replaced with the given size, and the CRC fixed up.
+static std::vector<unsigned char> with_size(std::vector<unsigned char> f, unsigned int w, unsigned int h) {
+	for (int k = 0; k < 4; k++) {
+		f[16 + k] = w >> (24 - 8 * k);
+		f[20 + k] = h >> (24 - 8 * k);
+	}
+	unsigned int c = crc32(f.data() + 12, 17);
+	for (int k = 0; k < 4; k++) {
+		f[29 + k] = c >> (24 - 8 * k);
+	}
+	return f;
+}
+
+// Sizes which are invalid, or which made the scale computations divide by zero or wrap around.
+static void test_header() {
+	std::string fn = temp_path("header.png");
+	png_writer pw(16, 16, 2, 8);
+	std::vector<unsigned char> px = random_pixels(pw, 9);
+	std::vector<unsigned char> f = pw.encode(px);
+	int errcd;
+	
+	unsigned int sizes[][2] = {{0, 16}, {16, 0}, {0, 0}, {0x80000000, 16}, {16, 0xFFFFFFFF}};
+	for (auto& s : sizes) {
+		CHECK(write_file(fn, with_size(f, s[0], s[1])));
+		img::img im;
+		img::png_opts opts;
+		CHECK(!decode(fn, im, opts, &errcd));
+		CHECK_EQ(errcd, -4);
+		
+		img::img im2;
+		opts.scale = 3;
+		CHECK(!decode(fn, im2, opts, &errcd));
+		CHECK_EQ(errcd, -4);
+	}
+	
+	// A 16 bit RGBA image 2^31 - 1 pixels wide fits in a sparse output file, but one of its scanlines takes 16 GB. Unless the system overcommits memory, decoding fails with -6, and otherwise with -3 as there is no image data.
+	std::string out = temp_path("header.raw");
+	png_writer wide(16, 1, 6, 16);
+	CHECK(write_file(fn, with_size(wide.encode(random_pixels(wide, 10)), 0x7FFFFFFF, 1)));
+	for (int cropped = 0; cropped < 2; cropped++) {
+		img::img im;
+		img::png_opts opts;
+		opts.out_fn = (char*) out.c_str();
+		if (cropped) {
+			opts.crop_x = 0x70000000;
+			opts.crop_w = 16;
+			opts.crop_h = 1;
+		}
+		CHECK(!decode(fn, im, opts, &errcd));
+		CHECK(errcd == -6 || errcd == -3);
+	}
+	remove(out.c_str());
+	
+	// An IHDR chunk which is too short.
+	std::vector<unsigned char> g(f.begin(), f.begin() + 8);
+	pw.chunk(g, "IHDR", f.data() + 16, 9);
+	g.insert(g.end(), f.begin() + 33, f.end());
+	CHECK(write_file(fn, g));
+	img::img im;
+	img::png_opts opts;
+	CHECK(!decode(fn, im, opts, &errcd));
+	CHECK_EQ(errcd, -5);
+	
+	// Scales and limits close to 2^32 produce a single pixel averaged over the whole image, rather than an empty image.
+	CHECK(write_file(fn, f));
+	unsigned long long sum[3] = {0, 0, 0};
+	for (size_t i = 0; i < px.size(); i++) {
+		sum[i % 3] += px[i];
+	}
+	
+	unsigned int huge[][3] = {{0xFFFFFFFF, 0, 0}, {0x80000001, 0, 0}, {1, 0xFFFFFFFF, 0}, {1, 0, 0xFFFFFFF0}};
+	for (auto& h : huge) {
+		img::img im3;
+		img::png_opts o;
+		o.scale = h[0];
+		o.max_width = h[1];
+		o.max_height = h[2];
+		if (h[1] != 0 || h[2] != 0) {
+			// A limit larger than the image leaves it as it is.
+			CHECK(decode(fn, im3, o, &errcd));
+			CHECK(same_pixels(im3, px));
+			continue;
+		}
+		CHECK(decode(fn, im3, o, &errcd));
+		CHECK_EQ(im3.width, 1);
+		CHECK_EQ(im3.height, 1);
+		for (int c = 0; c < 3; c++) {
+			CHECK(im3.data != NULL && im3.data[c] == (sum[c] + 128) / 256);
+		}
+	}
+	
+	// The same for an Adam-7 image, which is summed per output pixel.
+	png_writer pi(16, 16, 2, 8, true);
+	CHECK(pi.save(fn, px));
+	img::img im4;
+	img::png_opts o;
+	o.scale = 0xFFFFFFFF;
+	CHECK(decode(fn, im4, o, &errcd));
+	CHECK_EQ(im4.width, 1);
+	CHECK_EQ(im4.height, 1);
+	CHECK(im4.data != NULL && im4.data[0] == (sum[0] + 128) / 256);
+	
+	remove(fn.c_str());
+}
+
+int main() {
+	test_full_size();
+	test_scale();
+	test_max_size();
+	test_fish();
+	test_output();
+	test_errors();
+	test_header();
+	
+	return TEST_RESULT();
+}
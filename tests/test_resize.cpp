@@ -0,0 +1,220 @@
+// Resizes images built in memory with every filter, channel count and bit depth, and compares the SIMD kernels with the plain C++ ones.
+// Meant to also be run with SANITIZE=1, which catches kernels reading or writing past the ends of their rows.
+
+#include "../resize.hpp"
+#include "testing.hpp"
+
+using namespace testing;
+
+static const img::resize_filter filters[] = {img::RESIZE_NEAREST, img::RESIZE_BILINEAR, img::RESIZE_BICUBIC, img::RESIZE_LANCZOS3};
+static const char* filter_names[] = {"nearest", "bilinear", "bicubic", "lanczos3"};
+
+// Fill im with a w x h image of ch channels, the last of which is alpha for 2 and 4 channels. Samples come from px, or are random if px is empty.
+static void make_image(img::img& im, unsigned int w, unsigned int h, unsigned char ch, unsigned char depth, const std::vector<unsigned char>& px) {
+	im.width = w;
+	im.height = h;
+	im.bpp = ch * depth / 8;
+	im.pitch = (size_t) w * im.bpp;
+	im.bsize = im.pitch * h;
+	im.is_RGB = ch >= 3;
+	im.uses_palette = false;
+	im.alpha_mode = ch % 2 == 0 ? 1 : 0;
+	im.bit_depth = depth;
+	im.palette_length = 0;
+	im.palette = NULL;
+	im.data = (unsigned char*) malloc(im.bsize);
+	im.data_mode = 0;
+	
+	std::vector<unsigned char> d = px.empty() ? pattern(im.bsize, w * h + ch + depth) : px;
+	for (size_t i = 0; i < im.bsize; i++) {
+		im.data[i] = d[i % d.size()];
+	}
+}
+
+// Largest difference between two samples of the same images.
+static unsigned int max_difference(const img::img& a, const img::img& b) {
+	unsigned int m = 0;
+	unsigned int d;
+	size_t n = a.bit_depth == 16 ? a.bsize / 2 : a.bsize;
+	for (size_t i = 0; i < n; i++) {
+		if (a.bit_depth == 16) {
+			d = abs((a.data[2*i] << 8 | a.data[2*i+1]) - (b.data[2*i] << 8 | b.data[2*i+1]));
+		}
+		else {
+			d = abs(a.data[i] - b.data[i]);
+		}
+		if (d > m) m = d;
+	}
+	return m;
+}
+
+// Every filter keeps a constant image constant, whatever the scale. The sizes make both axes grow and shrink, by ratios which are not whole numbers.
+static void test_constant() {
+	unsigned int sizes[][4] = {{37, 23, 91, 50}, {37, 23, 10, 7}, {37, 23, 120, 5}, {5, 40, 3, 131}, {1, 1, 9, 4}, {64, 64, 1, 1}};
+	unsigned char depths[] = {8, 16};
+	
+	for (unsigned char depth : depths) {
+		for (unsigned char ch = 1; ch <= 4; ch++) {
+			// A pixel whose samples all differ, with opaque alpha so that premultiplying does not change it.
+			std::vector<unsigned char> px = {200, 17, 90, 43, 128, 255, 255, 255};
+			px.resize(ch * depth / 8);
+			if (ch % 2 == 0) {
+				for (unsigned int k = (ch - 1) * depth / 8; k < px.size(); k++) {
+					px[k] = 255;
+				}
+			}
+			
+			for (auto& s : sizes) {
+				img::img src;
+				make_image(src, s[0], s[1], ch, depth, px);
+				
+				for (int f = 0; f < 4; f++) {
+					img::resizer rs(s[0], s[1], s[2], s[3], filters[f]);
+					rs.threads = 3;
+					img::img dst;
+					int errcd;
+					CHECK(rs.run(src, dst, &errcd) == &dst);
+					CHECK_EQ(errcd, 0);
+					CHECK_EQ(dst.width, s[2]);
+					CHECK_EQ(dst.height, s[3]);
+					CHECK_EQ(dst.bpp, src.bpp);
+					CHECK_EQ(dst.bit_depth, depth);
+					
+					bool same = dst.data != NULL;
+					for (size_t i = 0; same && i < dst.bsize; i++) {
+						same = dst.data[i] == px[i % px.size()];
+					}
+					if (!same) {
+						printf("%s %ux%u -> %ux%u of a constant image with %d channels of %d bits is not constant\n", filter_names[f], s[0], s[1], s[2], s[3], ch, depth);
+						test_failures++;
+					}
+				}
+			}
+		}
+	}
+}
+
+// The SSE and AVX2 kernels only differ from the plain ones in the order of the additions, so no sample may be more than 1 away.
+static void test_simd() {
+#ifdef IMG_RESIZE_X86
+	if (!img::resize_has_avx2()) {
+		printf("%s: AVX2 not supported, only comparing the SSE kernels\n", __FILE__);
+	}
+#endif
+
+	unsigned int sizes[][4] = {{45, 31, 100, 77}, {45, 31, 13, 9}, {200, 3, 7, 11}, {3, 3, 17, 2}};
+	unsigned char depths[] = {8, 16};
+	
+	for (unsigned char depth : depths) {
+		for (unsigned char ch = 1; ch <= 4; ch++) {
+			for (auto& s : sizes) {
+				img::img src;
+				make_image(src, s[0], s[1], ch, depth, std::vector<unsigned char>());
+				
+				for (int f = 0; f < 4; f++) {
+					img::resizer rs(s[0], s[1], s[2], s[3], filters[f]);
+					rs.threads = 2;
+					img::img fast;
+					img::img plain;
+					int errcd;
+					CHECK(rs.run(src, fast, &errcd) != NULL);
+					rs.simd = false;
+					CHECK(rs.run(src, plain, &errcd) != NULL);
+					
+					unsigned int d = max_difference(fast, plain);
+					if (d > 1) {
+						printf("%s %ux%u -> %ux%u with %d channels of %d bits: SIMD and plain results differ by %u\n", filter_names[f], s[0], s[1], s[2], s[3], ch, depth, d);
+						test_failures++;
+					}
+				}
+			}
+		}
+	}
+}
+
+// Splitting the rows between threads does not change the result.
+static void test_threads() {
+	img::img src;
+	make_image(src, 61, 47, 4, 8, std::vector<unsigned char>());
+	img::resizer rs(61, 47, 29, 103, img::RESIZE_LANCZOS3);
+	
+	img::img one;
+	int errcd;
+	rs.threads = 1;
+	CHECK(rs.run(src, one, &errcd) != NULL);
+	
+	unsigned int counts[] = {0, 2, 3, 7, 200};
+	for (unsigned int n : counts) {
+		img::img many;
+		rs.threads = n;
+		CHECK(rs.run(src, many, &errcd) != NULL);
+		CHECK(many.data != NULL && memcmp(one.data, many.data, one.bsize) == 0);
+	}
+}
+
+// At the same size, nearest and bilinear copy the image.
+static void test_identity() {
+	for (unsigned char ch = 1; ch <= 4; ch++) {
+		img::img src;
+		make_image(src, 19, 11, ch, 16, std::vector<unsigned char>());
+		
+		img::resize_filter same[] = {img::RESIZE_NEAREST, img::RESIZE_BILINEAR};
+		for (img::resize_filter f : same) {
+			img::img dst;
+			img::resizer rs(19, 11, 19, 11, f);
+			rs.premultiply = false;
+			int errcd;
+			CHECK(rs.run(src, dst, &errcd) != NULL);
+			CHECK(dst.data != NULL && memcmp(src.data, dst.data, src.bsize) == 0);
+		}
+	}
+}
+
+static void test_errors() {
+	img::img src;
+	make_image(src, 8, 8, 1, 8, std::vector<unsigned char>());
+	img::img dst;
+	int errcd;
+	
+	img::resizer wrong_size(9, 8, 4, 4, img::RESIZE_BILINEAR);
+	CHECK(wrong_size.run(src, dst, &errcd) == NULL);
+	CHECK_EQ(errcd, -4);
+	
+	img::resizer empty(8, 8, 0, 4, img::RESIZE_BILINEAR);
+	CHECK(empty.run(src, dst, &errcd) == NULL);
+	CHECK_EQ(errcd, -4);
+	
+	img::resizer rs(8, 8, 4, 4, img::RESIZE_BILINEAR);
+	src.uses_palette = true;
+	CHECK(rs.run(src, dst, &errcd) == NULL);
+	CHECK_EQ(errcd, -4);
+	
+	src.uses_palette = false;
+	src.bit_depth = 4;
+	CHECK(rs.run(src, dst, &errcd) == NULL);
+	CHECK_EQ(errcd, -4);
+	
+	// 2^31 x 2^31 pixels of 16 bit RGBA take 2^65 bytes, which used to wrap around to 0.
+	img::img rgba;
+	make_image(rgba, 8, 8, 4, 16, std::vector<unsigned char>());
+	img::resizer huge(8, 8, 0x80000000, 0x80000000, img::RESIZE_BILINEAR);
+	CHECK(huge.run(rgba, dst, &errcd) == NULL);
+	CHECK_EQ(errcd, -4);
+	
+	// Shrinking by a huge factor takes at most every source sample per output sample.
+	img::img tall;
+	make_image(tall, 1, 3000, 1, 8, std::vector<unsigned char>(1, 77));
+	img::resizer shrink(1, 3000, 1, 1, img::RESIZE_LANCZOS3);
+	CHECK(shrink.run(tall, dst, &errcd) == &dst);
+	CHECK(dst.data != NULL && dst.data[0] == 77);
+}
+
+int main() {
+	test_constant();
+	test_simd();
+	test_threads();
+	test_identity();
+	test_errors();
+	
+	return TEST_RESULT();
+}
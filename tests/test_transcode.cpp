@@ -0,0 +1,185 @@
+// Runs the transcode tool over PNG files written by testing.hpp, and checks its raw, PPM and PAM output byte for byte against RGBA pixels worked out here.
+// Covers every color type and bit depth, and tRNS chunks for palette, gray and RGB images.
+
+#define main transcode_main
+#include "../transcode.cpp"
+#undef main
+
+#include "testing.hpp"
+
+using namespace testing;
+
+// Sample k of a row of packed samples.
+static unsigned int sample(const unsigned char* row, size_t k, unsigned char depth) {
+	if (depth == 16) return row[2*k] << 8 | row[2*k + 1];
+	if (depth == 8) return row[k];
+	size_t bit = k * depth;
+	return (row[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+}
+
+// The image as RGBA, with 16 bit samples (big-endian) for 16 bit images and 8 bit samples otherwise. Gray samples below 8 bits are scaled to the full range, and tRNS makes palette entries or one gray or RGB value transparent.
+static std::vector<unsigned char> rgba(const png_writer& pw, const std::vector<unsigned char>& px) {
+	unsigned int ch = channels_of(pw.color_type);
+	unsigned int depth = pw.bit_depth;
+	unsigned int max = (1 << depth) - 1;
+	unsigned int opaque = depth == 16 ? 65535 : 255;
+	std::vector<unsigned char> out;
+	unsigned int v[4];
+	unsigned int s[4];
+	
+	for (unsigned int y = 0; y < pw.height; y++) {
+		const unsigned char* row = px.data() + (size_t) y * pw.pitch();
+		for (unsigned int x = 0; x < pw.width; x++) {
+			for (unsigned int c = 0; c < ch; c++) {
+				s[c] = sample(row, (size_t) x * ch + c, depth);
+			}
+			
+			if (pw.color_type == 3) {
+				for (int c = 0; c < 3; c++) {
+					v[c] = pw.palette[3*s[0] + c];
+				}
+				v[3] = s[0] < pw.trns.size() ? pw.trns[s[0]] : 255;
+			} else {
+				bool color = pw.color_type == 2 || pw.color_type == 6;
+				for (int c = 0; c < 3; c++) {
+					v[c] = s[color ? c : 0];
+				}
+				v[3] = pw.color_type == 4 ? s[1] : pw.color_type == 6 ? s[3] : opaque;
+				
+				// The key is one or three 16 bit numbers.
+				if (!pw.trns.empty()) {
+					bool match = true;
+					for (unsigned int c = 0; c < ch; c++) {
+						match = match && s[c] == (unsigned int) (pw.trns[2*c] << 8 | pw.trns[2*c + 1]);
+					}
+					if (match) v[3] = 0;
+				}
+				if (pw.color_type == 0 && depth < 8) {
+					v[0] = v[1] = v[2] = v[0] * 255 / max;
+				}
+			}
+			
+			for (int c = 0; c < 4; c++) {
+				if (depth == 16) out.push_back(v[c] >> 8);
+				out.push_back(v[c]);
+			}
+		}
+	}
+	return out;
+}
+
+// Run the tool as from the command line. getopt() has to start over for each run.
+static int run_tool(std::vector<std::string> args) {
+	args.insert(args.begin(), "transcode");
+	std::vector<char*> argv;
+	for (std::string& a : args) {
+		argv.push_back((char*) a.c_str());
+	}
+	argv.push_back(NULL);
+	optind = 1;
+	return transcode_main(argv.size() - 1, argv.data());
+}
+
+class test_image {
+public:
+	std::string fn;
+	png_writer pw;
+	std::vector<unsigned char> px;
+	
+	test_image(const png_writer& pw) : pw(pw) {}
+};
+
+static void test_formats() {
+	// Color type, bit depth, interlacing, and whether to add a tRNS chunk.
+	unsigned char formats[][4] = {
+		{0, 1, 0, 0}, {0, 2, 0, 0}, {0, 4, 0, 0}, {0, 8, 0, 0}, {0, 16, 1, 0}, {2, 8, 0, 0}, {2, 16, 0, 0}, {3, 1, 0, 0}, {3, 4, 0, 0}, {3, 8, 1, 0}, {4, 8, 0, 0}, {4, 16, 0, 0}, {6, 8, 1, 0}, {6, 16, 0, 0},
+		{0, 2, 0, 1}, {0, 8, 0, 1}, {0, 16, 0, 1}, {2, 8, 1, 1}, {2, 16, 0, 1}, {3, 2, 0, 1}, {3, 8, 0, 1}
+	};
+	std::string dir = temp_path("transcode");
+	mkdir(dir.c_str(), 0755);
+	std::string out_dir = dir + "/out";
+	mkdir(out_dir.c_str(), 0755);
+	
+	std::vector<test_image> images;
+	unsigned int seed = 0;
+	for (auto& f : formats) {
+		test_image t(png_writer(13, 7, f[0], f[1], f[2]));
+		png_writer& pw = t.pw;
+		unsigned int entries = f[1] < 4 ? 1 << f[1] : 16;
+		if (f[0] == 3) {
+			pw.palette = pattern(3 * entries, seed);
+		}
+		t.px = random_pixels(pw, seed, entries);
+		
+		if (f[3]) {
+			if (f[0] == 3) {
+				// Entries past the end of tRNS stay opaque.
+				pw.trns = pattern(entries - 1, seed + 1);
+			} else {
+				// The value of the first pixel, so that some pixels are transparent.
+				for (unsigned int c = 0; c < channels_of(f[0]); c++) {
+					unsigned int s = sample(t.px.data(), c, f[1]);
+					pw.trns.push_back(s >> 8);
+					pw.trns.push_back(s);
+				}
+			}
+		}
+		
+		char name[32];
+		snprintf(name, sizeof(name), "/t%u.png", seed++);
+		t.fn = dir + name;
+		CHECK(pw.save(t.fn, t.px));
+		images.push_back(t);
+	}
+	
+	const char* formats_arg[] = {"raw", "ppm", "pam"};
+	for (int fmt = 0; fmt < 3; fmt++) {
+		std::vector<std::string> args = {"-o", out_dir, "-f", formats_arg[fmt], "-j", "3"};
+		for (test_image& t : images) {
+			args.push_back(t.fn);
+		}
+		CHECK_EQ(run_tool(args), 0);
+		
+		for (test_image& t : images) {
+			const png_writer& pw = t.pw;
+			std::vector<unsigned char> ref = rgba(pw, t.px);
+			unsigned int maxval = pw.bit_depth == 16 ? 65535 : 255;
+			char header[160];
+			
+			std::vector<unsigned char> expected;
+			if (fmt == FORMAT_RAW) {
+				expected = ref;
+			} else if (fmt == FORMAT_PPM) {
+				int n = snprintf(header, sizeof(header), "P6\n%u %u\n%u\n", pw.width, pw.height, maxval);
+				expected.assign(header, header + n);
+				size_t bytes = pw.bit_depth == 16 ? 2 : 1;
+				for (size_t i = 0; i < ref.size(); i += 4 * bytes) {
+					expected.insert(expected.end(), ref.begin() + i, ref.begin() + i + 3 * bytes);
+				}
+			} else {
+				int n = snprintf(header, sizeof(header), "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL %u\nTUPLTYPE RGB_ALPHA\nENDHDR\n", pw.width, pw.height, maxval);
+				expected.assign(header, header + n);
+				expected.insert(expected.end(), ref.begin(), ref.end());
+			}
+			
+			std::string out = out_dir + t.fn.substr(dir.size(), t.fn.size() - dir.size() - 4) + extensions[fmt];
+			if (read_file(out) != expected) {
+				printf("%s output of color type %d, depth %d, interlaced %d, tRNS %zu bytes differs\n", formats_arg[fmt], pw.color_type, pw.bit_depth, pw.interlaced, pw.trns.size());
+				test_failures++;
+			}
+			remove(out.c_str());
+		}
+	}
+	
+	for (test_image& t : images) {
+		remove(t.fn.c_str());
+	}
+	rmdir(out_dir.c_str());
+	rmdir(dir.c_str());
+}
+
+int main() {
+	test_formats();
+	
+	return TEST_RESULT();
+}
@@ -0,0 +1,217 @@
+// Inflates streams made by zlib itself and by the compressor in testing.hpp, fed to zlib_stream::inflate() in pieces of every size.
+
+#include "../zlib.hpp"
+#include "testing.hpp"
+
+using namespace testing;
+
+// zlib.compress() at level 9 of dynamic_text(), a single dynamic-Huffman block.
+static const unsigned char dynamic_stream[] = {
+	0x78, 0xda, 0xb5, 0x94, 0xc9, 0x11, 0xc2, 0x30, 0x0c, 0x45, 0x5b, 0x51, 0x05, 0x4c, 0xbc, 0xc9, 0x32, 0xdd, 0x00, 0x09, 0x3b, 0x18, 0x02, 0x81, 0x40, 0xf5, 0xcc, 0xd0, 0xc1, 0x3b, 0xf8, 0x6c,
+	0x6b, 0xf4, 0xf5, 0xb7, 0x6e, 0x29, 0xcf, 0xfd, 0x20, 0xf7, 0xe9, 0xb0, 0x39, 0xc9, 0x7a, 0xac, 0xef, 0xab, 0x6c, 0xeb, 0x2c, 0xc7, 0xe9, 0x72, 0x7b, 0x48, 0x7d, 0x0d, 0xe3, 0xff, 0xf9, 0xbc,
+	0xfa, 0x7e, 0xa4, 0xaf, 0xbb, 0x85, 0x38, 0xf8, 0x3f, 0xc2, 0xff, 0x85, 0xe2, 0x51, 0x38, 0xe0, 0x13, 0x1c, 0x08, 0x74, 0x43, 0xa4, 0x37, 0x28, 0x25, 0xc9, 0xa8, 0x0a, 0x81, 0x92, 0x44, 0x11,
+	0xc5, 0x0c, 0x07, 0xb2, 0xa7, 0x90, 0xe8, 0xc9, 0x94, 0x23, 0xa5, 0x1b, 0x0a, 0x76, 0x12, 0x95, 0x21, 0x77, 0x34, 0x0d, 0xf4, 0x86, 0x44, 0x21, 0x15, 0x9c, 0x06, 0xdc, 0x00, 0xb8, 0x62, 0xf0,
+	0x0d, 0x14, 0x52, 0xa2, 0x3a, 0x18, 0xf5, 0x1e, 0xb5, 0x92, 0xa7, 0x79, 0x33, 0x0a, 0x29, 0x51, 0x92, 0x3c, 0xf5, 0x9e, 0xe1, 0x9e, 0xc4, 0xb5, 0x47, 0x69, 0x75, 0x74, 0x83, 0xd1, 0x38, 0x28,
+	0xce, 0x0f, 0x15, 0x2e, 0x50, 0x1d, 0x1c, 0x76, 0x2b, 0xcd, 0x1b, 0x0d, 0xa8, 0x51, 0xdd, 0x32, 0xb5, 0x52, 0xc6, 0x1b, 0x42, 0xf3, 0x81, 0xe6, 0x47, 0x63, 0x5a, 0xb1, 0x70, 0xda, 0xda, 0x7a,
+	0xd8, 0xdc, 0x38, 0x3e, 0x38, 0xa0, 0xb8, 0x02, 0x7e, 0x78, 0x95, 0xfc, 0xd7
+};
+
+static std::vector<unsigned char> dynamic_text() {
+	std::string t;
+	char buf[64];
+	for (int i = 0; i < 60; i++) {
+		snprintf(buf, sizeof(buf), "%d: the quick brown fox jumps over the lazy dog. ", i * i % 97);
+		t += buf;
+	}
+	return std::vector<unsigned char>(t.begin(), t.end());
+}
+
+// Inflate z, handing it to the stream step bytes at a time. Each piece is a separate input file, as PNG IDAT chunks are.
+// Returns whether every call succeeded, and sets finished to whether the end of the stream was reached.
+static bool inflate_pieces(const std::vector<unsigned char>& z, size_t step, std::vector<unsigned char>& out, bool* finished) {
+	char* buf = NULL;
+	size_t buf_size = 0;
+	FILE* fo = open_memstream(&buf, &buf_size);
+	
+	util::zlib_stream zs(NULL, fo);
+	bool ok = true;
+	for (size_t off = 0; off < z.size() && ok; off += step) {
+		size_t n = z.size() - off < step ? z.size() - off : step;
+		FILE* fi = fmemopen((void*) (z.data() + off), n, "rb");
+		zs.set_in(fi);
+		ok = zs.inflate(n);
+		zs.close_in();
+	}
+	*finished = zs.finished();
+	zs.close_out();
+	
+	out.assign(buf, buf + buf_size);
+	free(buf);
+	return ok;
+}
+
+static void test_dynamic() {
+	std::vector<unsigned char> z(dynamic_stream, dynamic_stream + sizeof(dynamic_stream));
+	std::vector<unsigned char> text = dynamic_text();
+	std::vector<unsigned char> out;
+	bool finished;
+	
+	size_t steps[] = {z.size(), 1, 2, 3, 5, 64};
+	for (size_t step : steps) {
+		CHECK(inflate_pieces(z, step, out, &finished));
+		CHECK(finished);
+		CHECK(out == text);
+	}
+	
+	// Every point at which the stream can be cut in two.
+	for (size_t cut = 1; cut < z.size(); cut++) {
+		std::vector<unsigned char> a(z.begin(), z.begin() + cut);
+		std::vector<unsigned char> b(z.begin() + cut, z.end());
+		
+		char* buf = NULL;
+		size_t buf_size = 0;
+		FILE* fo = open_memstream(&buf, &buf_size);
+		util::zlib_stream zs(fmemopen(a.data(), a.size(), "rb"), fo);
+		CHECK(zs.inflate(a.size()));
+		CHECK(!zs.finished());
+		zs.close_in();
+		zs.set_in(fmemopen(b.data(), b.size(), "rb"));
+		CHECK(zs.inflate(b.size()));
+		CHECK(zs.finished());
+		zs.close_in();
+		zs.close_out();
+		
+		CHECK(std::vector<unsigned char>(buf, buf + buf_size) == text);
+		free(buf);
+	}
+}
+
+// Stored and fixed-Huffman streams, including ones longer than the 32 KiB window.
+static void test_round_trip() {
+	size_t sizes[] = {0, 1, 100, 5000, 70000, 300000};
+	size_t steps[] = {1, 7, 4096, 1 << 20};
+	std::vector<unsigned char> out;
+	bool finished;
+	
+	for (size_t n : sizes) {
+		std::vector<unsigned char> d = pattern(n, n);
+		zlib_mode modes[] = {ZLIB_STORED, ZLIB_FIXED};
+		for (zlib_mode mode : modes) {
+			std::vector<unsigned char> z = zlib_compress(d.data(), d.size(), mode, 1000);
+			for (size_t step : steps) {
+				if (step == 1 && n > 5000) continue;
+				CHECK(inflate_pieces(z, step, out, &finished));
+				CHECK(finished);
+				CHECK(out == d);
+			}
+		}
+	}
+	
+	// Runs of a single byte are encoded as overlapping back-references.
+	std::vector<unsigned char> d(100000, 'x');
+	std::vector<unsigned char> z = zlib_compress(d.data(), d.size(), ZLIB_FIXED);
+	CHECK(z.size() < 1000);
+	CHECK(inflate_pieces(z, 10, out, &finished));
+	CHECK(finished);
+	CHECK(out == d);
+}
+
+// inflate(n) reads exactly n bytes from a stream which holds more, and decodes them before returning. PNG_CRC_SLICED relies on this to inflate each slice of a chunk right after checking it.
+static void test_bounded() {
+	std::vector<unsigned char> d = pattern(200000, 8);
+	std::vector<unsigned char> z = zlib_compress(d.data(), d.size(), ZLIB_STORED);
+	char* buf = NULL;
+	size_t buf_size = 0;
+	FILE* fo = open_memstream(&buf, &buf_size);
+	FILE* fi = fmemopen(z.data(), z.size(), "rb");
+	util::zlib_stream zs(fi, fo);
+	
+	size_t off = 0;
+	size_t last = 0;
+	while (off < z.size()) {
+		size_t n = z.size() - off < 30000 ? z.size() - off : 30000;
+		CHECK(zs.inflate(n));
+		off += n;
+		CHECK_EQ(ftell(fi), off);
+		
+		// Stored data comes out as soon as it goes in, less the zlib header and block headers.
+		fflush(fo);
+		CHECK(buf_size > last);
+		CHECK(buf_size + 100 > off);
+		last = buf_size;
+	}
+	CHECK(zs.finished());
+	zs.close_in();
+	zs.close_out();
+	CHECK(std::vector<unsigned char>(buf, buf + buf_size) == d);
+	free(buf);
+}
+
+static void test_invalid() {
+	std::vector<unsigned char> d = pattern(20000, 3);
+	std::vector<unsigned char> good = zlib_compress(d.data(), d.size(), ZLIB_FIXED);
+	std::vector<unsigned char> out;
+	bool finished;
+	
+	// Checksum.
+	std::vector<unsigned char> z = good;
+	z[z.size() - 1] ^= 1;
+	CHECK(!inflate_pieces(z, z.size(), out, &finished));
+	CHECK(!finished);
+	
+	// Header: wrong method, bad check bits, preset dictionary.
+	unsigned char heads[][2] = {{0x79, 0x01}, {0x78, 0x02}, {0x78, 0x20}};
+	for (auto& h : heads) {
+		z = good;
+		z[0] = h[0];
+		z[1] = h[1];
+		CHECK(!inflate_pieces(z, 3, out, &finished));
+	}
+	
+	// Block type 3.
+	z = {0x78, 0x01, 0x07, 0, 0, 0, 0};
+	CHECK(!inflate_pieces(z, z.size(), out, &finished));
+	
+	// Stored block whose length does not match its complement.
+	z = {0x78, 0x01, 0x01, 0x05, 0x00, 0xFA, 0xFE, 1, 2, 3, 4, 5};
+	CHECK(!inflate_pieces(z, z.size(), out, &finished));
+	
+	// A back-reference to before the start of the data: length 3, distance 1, as the first code of a fixed block.
+	std::vector<unsigned char> bad;
+	bad.push_back(0x78);
+	bad.push_back(0x01);
+	bit_writer w(bad);
+	w.put(1, 1);
+	w.put(1, 2);
+	put_fixed_literal(w, 257);
+	w.put_code(0, 5);
+	put_fixed_literal(w, 256);
+	w.align();
+	CHECK(!inflate_pieces(bad, bad.size(), out, &finished));
+	
+	// Once invalid, a stream stays invalid.
+	util::zlib_stream zs(fmemopen(bad.data(), bad.size(), "rb"), NULL);
+	CHECK(!zs.inflate(bad.size()));
+	CHECK(!zs.inflate(0));
+	zs.close_in();
+	
+	// A stream which is cut off is not an error, it just is not finished.
+	z = good;
+	z.resize(z.size() / 2);
+	CHECK(inflate_pieces(z, 100, out, &finished));
+	CHECK(!finished);
+	CHECK(out.size() < d.size());
+	CHECK(memcmp(out.data(), d.data(), out.size()) == 0);
+}
+
+int main() {
+	test_dynamic();
+	test_round_trip();
+	test_bounded();
+	test_invalid();
+	
+	util::zlib_stream zs;
+	CHECK(!zs.deflate(0));
+	
+	return TEST_RESULT();
+}
@@ -0,0 +1,496 @@
+#ifndef img_testing
+#define img_testing
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+// Helpers shared by the tests in this directory. Each test is a program of its own which prints the checks that fail and exits with 1 if there were any, see run.sh.
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); test_failures++; } } while (0)
+#define CHECK_EQ(a, b) do { long long check_a = (long long) (a); long long check_b = (long long) (b); if (check_a != check_b) { printf("%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #a, #b, check_a, check_b); test_failures++; } } while (0)
+
+// Returns the exit code of a test program.
+#define TEST_RESULT() (test_failures == 0 ? (printf("%s: ok\n", __FILE__), 0) : (printf("%s: %d failed\n", __FILE__, test_failures), 1))
+
+namespace testing {
+	// A file in the temporary directory, named after the test and the process so tests can run side by side.
+	std::string temp_path(const char* name) {
+		const char* dir = getenv("TMPDIR");
+		char buf[64];
+		snprintf(buf, sizeof(buf), "/img_test_%d_", (int) getpid());
+		return std::string(dir != NULL ? dir : "/tmp") + buf + name;
+	}
+	
+	// Path of a file in the root of the repository. run.sh runs the tests from there.
+	std::string repo_path(const char* name) {
+		const char* dir = getenv("IMG_ROOT");
+		return std::string(dir != NULL ? dir : ".") + "/" + name;
+	}
+	
+	bool write_file(const std::string& fn, const std::vector<unsigned char>& d) {
+		FILE* fp = fopen(fn.c_str(), "wb");
+		if (fp == NULL) return false;
+		bool ok = fwrite(d.data(), 1, d.size(), fp) == d.size();
+		return fclose(fp) == 0 && ok;
+	}
+	
+	// The contents of a file, or nothing if it cannot be read.
+	std::vector<unsigned char> read_file(const std::string& fn) {
+		std::vector<unsigned char> d;
+		FILE* fp = fopen(fn.c_str(), "rb");
+		if (fp == NULL) return d;
+		unsigned char buf[65536];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+			d.insert(d.end(), buf, buf + n);
+		}
+		fclose(fp);
+		return d;
+	}
+	
+	// 64 bit FNV-1a hash, used to compare large decoded images against known values.
+	unsigned long long fnv1a(const unsigned char* d, size_t n) {
+		unsigned long long h = 0xcbf29ce484222325ULL;
+		for (size_t i = 0; i < n; i++) {
+			h = (h ^ d[i]) * 0x100000001b3ULL;
+		}
+		return h;
+	}
+	
+	// Deterministic pseudo-random numbers, so that every run sees the same images.
+	class rng {
+	public:
+		unsigned long long s;
+		
+		rng(unsigned long long seed) : s(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+		
+		unsigned int next() {
+			s ^= s << 13;
+			s ^= s >> 7;
+			s ^= s << 17;
+			return (unsigned int) (s >> 32);
+		}
+		
+		unsigned int below(unsigned int n) {return next() % n;}
+	};
+	
+	// Bytes which are smooth in places and noisy in others, so that compressed data contains both literals and back-references.
+	std::vector<unsigned char> pattern(size_t n, unsigned int seed) {
+		rng r(seed);
+		std::vector<unsigned char> d(n);
+		unsigned char v = 0;
+		for (size_t i = 0; i < n; i++) {
+			switch ((i / 97 + seed) % 4) {
+				case 0:
+					v = r.next();
+					break;
+				case 1:
+					v += 3;
+					break;
+				case 2:
+					v = i >= 5 ? d[i - 5] : 7;
+					break;
+				default:
+					v = (i * i) >> 5;
+			}
+			d[i] = v;
+		}
+		return d;
+	}
+	
+	/* zlib */
+	
+	unsigned int adler32(const unsigned char* d, size_t n) {
+		unsigned int a = 1;
+		unsigned int b = 0;
+		for (size_t i = 0; i < n; i++) {
+			a = (a + d[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		return (b << 16) | a;
+	}
+	
+	unsigned int crc32(const unsigned char* d, size_t n) {
+		unsigned int c = 0xFFFFFFFF;
+		for (size_t i = 0; i < n; i++) {
+			c ^= d[i];
+			for (int k = 0; k < 8; k++) {
+				c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			}
+		}
+		return c ^ 0xFFFFFFFF;
+	}
+	
+	// Writes bits starting with the least significant bit of each byte, as deflate does.
+	class bit_writer {
+	public:
+		std::vector<unsigned char>& out;
+		unsigned int acc;
+		int n;
+		
+		bit_writer(std::vector<unsigned char>& out) : out(out), acc(0), n(0) {}
+		
+		void put(unsigned int v, int bits) {
+			for (int i = 0; i < bits; i++) {
+				acc |= ((v >> i) & 1) << n;
+				if (++n == 8) {
+					out.push_back(acc);
+					acc = 0;
+					n = 0;
+				}
+			}
+		}
+		
+		// Huffman codes are stored starting with their most significant bit.
+		void put_code(unsigned int code, int bits) {
+			for (int i = bits - 1; i >= 0; i--) {
+				put((code >> i) & 1, 1);
+			}
+		}
+		
+		void align() {
+			if (n > 0) put(0, 8 - n);
+		}
+	};
+	
+	enum zlib_mode {ZLIB_STORED, ZLIB_FIXED};
+	
+	static const unsigned short test_len_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	static const unsigned char test_len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	static const unsigned short test_dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+	static const unsigned char test_dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+	
+	void put_fixed_literal(bit_writer& w, unsigned int v) {
+		if (v < 144) {
+			w.put_code(0x30 + v, 8);
+		} else if (v < 256) {
+			w.put_code(0x190 + v - 144, 9);
+		} else if (v < 280) {
+			w.put_code(v - 256, 7);
+		} else {
+			w.put_code(0xC0 + v - 280, 8);
+		}
+	}
+	
+	// Compress into a zlib stream made of stored blocks of at most block bytes, or of a single fixed-Huffman block with greedy matching.
+	std::vector<unsigned char> zlib_compress(const unsigned char* d, size_t n, zlib_mode mode, size_t block = 65535) {
+		std::vector<unsigned char> z;
+		z.push_back(0x78);
+		z.push_back(0x01);
+		bit_writer w(z);
+		
+		if (mode == ZLIB_STORED) {
+			size_t off = 0;
+			do {
+				size_t k = n - off < block ? n - off : block;
+				w.put(off + k == n, 1);
+				w.put(0, 2);
+				w.align();
+				w.put(k, 16);
+				w.put(~k & 0xFFFF, 16);
+				for (size_t i = 0; i < k; i++) {
+					w.put(d[off + i], 8);
+				}
+				off += k;
+			} while (off < n);
+		} else {
+			w.put(1, 1);
+			w.put(1, 2);
+			
+			// Last position of each 3 byte sequence.
+			std::vector<long long> head(1 << 16, -1);
+			size_t i = 0;
+			while (i < n) {
+				size_t len = 0;
+				size_t dist = 0;
+				if (i + 3 <= n) {
+					unsigned int h = (d[i] << 8 ^ d[i + 1] << 4 ^ d[i + 2]) & 0xFFFF;
+					long long c = head[h];
+					head[h] = i;
+					if (c >= 0 && i - c <= 32768) {
+						while (len < 258 && i + len < n && d[c + len] == d[i + len]) len++;
+						dist = i - c;
+					}
+				}
+				
+				if (len < 3) {
+					put_fixed_literal(w, d[i]);
+					i++;
+					continue;
+				}
+				
+				int ls = 28;
+				while (test_len_base[ls] > len) ls--;
+				put_fixed_literal(w, 257 + ls);
+				w.put(len - test_len_base[ls], test_len_extra[ls]);
+				
+				int ds = 29;
+				while (test_dist_base[ds] > dist) ds--;
+				w.put_code(ds, 5);
+				w.put(dist - test_dist_base[ds], test_dist_extra[ds]);
+				
+				i += len;
+			}
+			put_fixed_literal(w, 256);
+		}
+		
+		w.align();
+		unsigned int a = adler32(d, n);
+		for (int k = 24; k >= 0; k -= 8) {
+			z.push_back(a >> k);
+		}
+		return z;
+	}
+	
+	/* PNG */
+	
+	static const unsigned char test_adam7[7][4] = {{0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4}, {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}};
+	
+	unsigned char channels_of(unsigned char color_type) {
+		switch (color_type) {
+			case 2:
+				return 3;
+			case 4:
+				return 2;
+			case 6:
+				return 4;
+			default:
+				return 1;
+		}
+	}
+	
+	// Read or write pixel x of a packed row of pixels of bits_pp bits each.
+	void get_pixel(const unsigned char* row, size_t x, unsigned int bits_pp, unsigned char* px) {
+		if (bits_pp >= 8) {
+			memcpy(px, row + x * (bits_pp / 8), bits_pp / 8);
+		} else {
+			size_t bit = x * bits_pp;
+			*px = (row[bit / 8] >> (8 - bits_pp - bit % 8)) & ((1 << bits_pp) - 1);
+		}
+	}
+	
+	void set_pixel(unsigned char* row, size_t x, unsigned int bits_pp, const unsigned char* px) {
+		if (bits_pp >= 8) {
+			memcpy(row + x * (bits_pp / 8), px, bits_pp / 8);
+		} else {
+			size_t bit = x * bits_pp;
+			unsigned int shift = 8 - bits_pp - bit % 8;
+			row[bit / 8] = (row[bit / 8] & ~(((1 << bits_pp) - 1) << shift)) | (*px << shift);
+		}
+	}
+	
+	unsigned char paeth(int a, int b, int c) {
+		int p = a + b - c;
+		int pa = abs(p - a);
+		int pb = abs(p - b);
+		int pc = abs(p - c);
+		if (pa <= pb && pa <= pc) return a;
+		return pb <= pc ? b : c;
+	}
+	
+	// Builds PNG files from packed pixel rows, the layout img::load_png() produces.
+	class png_writer {
+	public:
+		unsigned int width;
+		unsigned int height;
+		unsigned char color_type;
+		unsigned char bit_depth;
+		bool interlaced;
+		
+		// PLTE and tRNS contents, left out if empty.
+		std::vector<unsigned char> palette;
+		std::vector<unsigned char> trns;
+		
+		// Compressed data is split into IDAT chunks of this many bytes.
+		size_t idat_size;
+		zlib_mode mode;
+		
+		// Filter type of each scanline, cycling through all five if negative.
+		int filter;
+		
+		// Text of a tEXt chunk written before the image data, left out if empty.
+		std::string text;
+		
+		// Offsets of the IDAT chunks in the last file written, pointing at their length fields.
+		std::vector<size_t> idat_offsets;
+		
+		png_writer(unsigned int width, unsigned int height, unsigned char color_type, unsigned char bit_depth, bool interlaced = false) : width(width), height(height), color_type(color_type), bit_depth(bit_depth), interlaced(interlaced), idat_size(1000), mode(ZLIB_FIXED), filter(-1) {}
+		
+		unsigned int bits_pp() const {return channels_of(color_type) * bit_depth;}
+		size_t pitch() const {return ((size_t) width * bits_pp() + 7) / 8;}
+		
+		// The filtered scanlines of every pass, before compression.
+		std::vector<unsigned char> scanlines(const std::vector<unsigned char>& px) const {
+			std::vector<unsigned char> s;
+			unsigned int bpp = bits_pp();
+			unsigned int fbpp = bpp < 8 ? 1 : bpp / 8;
+			unsigned char p[8];
+			unsigned int rows = 0;
+			
+			for (int pass = 0; pass < (interlaced ? 7 : 1); pass++) {
+				unsigned int x0 = interlaced ? test_adam7[pass][0] : 0;
+				unsigned int y0 = interlaced ? test_adam7[pass][1] : 0;
+				unsigned int dx = interlaced ? test_adam7[pass][2] : 1;
+				unsigned int dy = interlaced ? test_adam7[pass][3] : 1;
+				if (x0 >= width || y0 >= height) continue;
+				
+				unsigned int pw = (width - x0 + dx - 1) / dx;
+				size_t rb = ((size_t) pw * bpp + 7) / 8;
+				std::vector<unsigned char> prev(rb, 0);
+				std::vector<unsigned char> cur(rb);
+				
+				for (unsigned int y = y0; y < height; y += dy) {
+					std::fill(cur.begin(), cur.end(), 0);
+					for (unsigned int i = 0; i < pw; i++) {
+						get_pixel(px.data() + (size_t) y * pitch(), x0 + i * dx, bpp, p);
+						set_pixel(cur.data(), i, bpp, p);
+					}
+					
+					unsigned char f = filter >= 0 ? filter : rows % 5;
+					rows++;
+					s.push_back(f);
+					for (size_t i = 0; i < rb; i++) {
+						int a = i >= fbpp ? cur[i - fbpp] : 0;
+						int b = prev[i];
+						int c = i >= fbpp ? prev[i - fbpp] : 0;
+						int pred = f == 1 ? a : f == 2 ? b : f == 3 ? (a + b) / 2 : f == 4 ? paeth(a, b, c) : 0;
+						s.push_back(cur[i] - pred);
+					}
+					prev = cur;
+				}
+			}
+			return s;
+		}
+		
+		void chunk(std::vector<unsigned char>& f, const char* type, const unsigned char* d, size_t n) {
+			for (int k = 24; k >= 0; k -= 8) {
+				f.push_back(n >> k);
+			}
+			size_t start = f.size();
+			f.insert(f.end(), type, type + 4);
+			f.insert(f.end(), d, d + n);
+			unsigned int c = crc32(f.data() + start, n + 4);
+			for (int k = 24; k >= 0; k -= 8) {
+				f.push_back(c >> k);
+			}
+		}
+		
+		std::vector<unsigned char> encode(const std::vector<unsigned char>& px) {
+			std::vector<unsigned char> f = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+			
+			unsigned char ihdr[13] = {(unsigned char) (width >> 24), (unsigned char) (width >> 16), (unsigned char) (width >> 8), (unsigned char) width, (unsigned char) (height >> 24), (unsigned char) (height >> 16), (unsigned char) (height >> 8), (unsigned char) height, bit_depth, color_type, 0, 0, interlaced};
+			chunk(f, "IHDR", ihdr, 13);
+			if (!palette.empty()) chunk(f, "PLTE", palette.data(), palette.size());
+			if (!trns.empty()) chunk(f, "tRNS", trns.data(), trns.size());
+			if (!text.empty()) chunk(f, "tEXt", (const unsigned char*) text.c_str(), text.size());
+			
+			std::vector<unsigned char> s = scanlines(px);
+			std::vector<unsigned char> z = zlib_compress(s.data(), s.size(), mode);
+			idat_offsets.clear();
+			for (size_t off = 0; off < z.size(); off += idat_size) {
+				idat_offsets.push_back(f.size());
+				chunk(f, "IDAT", z.data() + off, z.size() - off < idat_size ? z.size() - off : idat_size);
+			}
+			
+			chunk(f, "IEND", NULL, 0);
+			return f;
+		}
+		
+		bool save(const std::string& fn, const std::vector<unsigned char>& px) {
+			return write_file(fn, encode(px));
+		}
+	};
+	
+	// Random pixels for an image. Palette images only use the first entries entries.
+	std::vector<unsigned char> random_pixels(const png_writer& pw, unsigned int seed, unsigned int entries = 256) {
+		rng r(seed);
+		std::vector<unsigned char> px(pw.pitch() * pw.height);
+		if (pw.color_type == 3) {
+			for (unsigned int y = 0; y < pw.height; y++) {
+				for (unsigned int x = 0; x < pw.width; x++) {
+					unsigned char v = r.below(entries < (1u << pw.bit_depth) ? entries : 1u << pw.bit_depth);
+					set_pixel(px.data() + (size_t) y * pw.pitch(), x, pw.bits_pp(), &v);
+				}
+			}
+		} else {
+			// Smooth enough for the filters to matter, noisy enough for averaging to be checked.
+			for (size_t i = 0; i < px.size(); i++) {
+				px[i] = (i * 7 + r.below(64)) & 0xFF;
+			}
+		}
+		
+		// Bits after the last pixel of a row are not part of the image, and decode as 0.
+		unsigned int pad = pw.pitch() * 8 - (size_t) pw.width * pw.bits_pp();
+		for (unsigned int y = 0; y < pw.height; y++) {
+			px[(y + 1) * pw.pitch() - 1] &= 0xFF << pad;
+		}
+		return px;
+	}
+	
+	// The step of the grid load_png() samples a downscaled Adam-7 image on when png_opts::early_passes is set: the largest of 8, 4 and 2 that divides the scale and the origin of the region, or 1.
+	unsigned int adam7_grid(const png_writer& pw, unsigned int scale, unsigned int x = 0, unsigned int y = 0) {
+		if (pw.interlaced) {
+			for (unsigned int g = 8; g > 1; g /= 2) {
+				if (scale % g == 0 && x % g == 0 && y % g == 0) return g;
+			}
+		}
+		return 1;
+	}
+	
+	// What load_png() produces when downscaling by scale, averaging only the pixels on a grid of the given step.
+	std::vector<unsigned char> box_reference(const png_writer& pw, const std::vector<unsigned char>& px, unsigned int scale, unsigned int grid) {
+		unsigned int channels = channels_of(pw.color_type);
+		unsigned int bytes = pw.bit_depth / 8;
+		unsigned int ow = (pw.width + scale - 1) / scale;
+		unsigned int oh = (pw.height + scale - 1) / scale;
+		
+		std::vector<unsigned char> out((size_t) ow * oh * channels * bytes);
+		for (unsigned int oy = 0; oy < oh; oy++) {
+			for (unsigned int ox = 0; ox < ow; ox++) {
+				for (unsigned int c = 0; c < channels; c++) {
+					unsigned long long sum = 0;
+					unsigned long long n = 0;
+					for (unsigned int y = oy * scale; y < (oy + 1) * scale && y < pw.height; y += grid) {
+						for (unsigned int x = ox * scale; x < (ox + 1) * scale && x < pw.width; x += grid) {
+							const unsigned char* s = px.data() + (size_t) y * pw.pitch() + ((size_t) x * channels + c) * bytes;
+							sum += bytes == 2 ? s[0] << 8 | s[1] : s[0];
+							n++;
+						}
+					}
+					unsigned long long v = (sum + n / 2) / n;
+					unsigned char* d = out.data() + (((size_t) oy * ow + ox) * channels + c) * bytes;
+					if (bytes == 2) {
+						d[0] = v >> 8;
+						d[1] = v & 0xFF;
+					} else {
+						d[0] = v;
+					}
+				}
+			}
+		}
+		return out;
+	}
+	
+	// The w x h rectangle at (x, y) of an image, repacked so that every row starts on a byte boundary.
+	std::vector<unsigned char> crop_pixels(const png_writer& pw, const std::vector<unsigned char>& px, unsigned int x, unsigned int y, unsigned int w, unsigned int h) {
+		size_t pitch = ((size_t) w * pw.bits_pp() + 7) / 8;
+		std::vector<unsigned char> out(pitch * h, 0);
+		unsigned char p[8];
+		for (unsigned int j = 0; j < h; j++) {
+			for (unsigned int i = 0; i < w; i++) {
+				get_pixel(px.data() + (size_t) (y + j) * pw.pitch(), x + i, pw.bits_pp(), p);
+				set_pixel(out.data() + (size_t) j * pitch, i, pw.bits_pp(), p);
+			}
+		}
+		return out;
+	}
+}
+
+#endif
@@ -0,0 +1,575 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "img.hpp"
+#include "apng.hpp"
+
+// Limits of the -j, -r, -w and -q options.
+#define IMG_TRANSCODE_MAX_THREADS 1024
+#define IMG_TRANSCODE_MAX_DEPTH 65536
+
+// Converts PNG files to raw RGBA, PPM or PAM.
+// Reading, decoding and writing run as three stages connected by bounded queues, so disk and CPU are kept busy at the same time while only a limited number of files are held in memory.
+
+enum out_format {FORMAT_RAW, FORMAT_PPM, FORMAT_PAM};
+
+static const char* extensions[] = {".rgba", ".ppm", ".pam"};
+
+// Why a file failed to decode, by the negated error code of img.hpp. Only printed with -v.
+static const char* decode_errors[] = {"Failed to decode", "Failed to decode: could not open the file", "Failed to decode: not a PNG file", "Failed to decode: the file is truncated or corrupted", "Failed to decode: unsupported format", "Failed to decode: corrupted data or a failed checksum", "Failed to decode: out of memory"};
+
+// A queue which blocks producers while it is full and consumers while it is empty.
+template <class T> class bounded_queue {
+public:
+	bounded_queue(size_t cap) : cap(cap), closed(false) {}
+	
+	void push(T v) {
+		std::unique_lock<std::mutex> l(lock);
+		while (items.size() >= cap) {
+			not_full.wait(l);
+		}
+		items.push_back(v);
+		not_empty.notify_one();
+	}
+	
+	// Returns false once the queue has been closed and emptied.
+	bool pop(T& v) {
+		std::unique_lock<std::mutex> l(lock);
+		while (items.empty() && !closed) {
+			not_empty.wait(l);
+		}
+		if (items.empty()) return false;
+		
+		v = items.front();
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+	
+	// Called once every producer is done.
+	void close() {
+		std::lock_guard<std::mutex> l(lock);
+		closed = true;
+		not_empty.notify_all();
+	}
+
+private:
+	size_t cap;
+	bool closed;
+	std::deque<T> items;
+	
+	std::mutex lock;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+};
+
+// One file on its way through the pipeline.
+class job {
+public:
+	std::string in;
+	std::string out;
+	
+	// Contents of the input file.
+	unsigned char* file;
+	size_t file_len;
+	
+	// Header and pixels of the output file.
+	unsigned char* px;
+	size_t px_len;
+	
+	std::chrono::steady_clock::time_point start;
+	
+	job() : file(NULL), file_len(0), px(NULL), px_len(0) {}
+	
+	~job() {
+		free(file);
+		free(px);
+	}
+};
+
+class transcoder {
+public:
+	out_format format;
+	std::string out_dir;
+	img::png_opts opts;
+	
+	// Describe why files failed to decode. The decoder's own messages are never enabled: they go to stdout, along with the contents of tEXt chunks.
+	bool verbose;
+	
+	unsigned int readers;
+	unsigned int decoders;
+	unsigned int writers;
+	
+	transcoder(size_t depth) : verbose(false), failed(0), bytes_in(0), bytes_out(0), to_decode(depth), to_write(depth) {}
+	
+	// Convert every file, returns the number of failures.
+	size_t run(const std::vector<std::string>& files);
+
+private:
+	// Inputs and the output file each is written to.
+	std::vector<std::string> files;
+	std::vector<std::string> outs;
+	size_t next_file;
+	
+	// Guards next_file and the totals below.
+	std::mutex lock;
+	
+	// Totals, and the time each file took from the start of its read to the end of its write.
+	std::vector<double> latency;
+	size_t failed;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	
+	bounded_queue<job*> to_decode;
+	bounded_queue<job*> to_write;
+	
+	void read_stage();
+	void decode_stage();
+	void write_stage();
+	
+	void fail(job* j, const char* why, int errcd);
+	
+	// The output is named after the input, with its extension replaced.
+	std::string output_name(const std::string& in);
+	
+	// Convert a decoded image to the output format.
+	bool convert(const img::img& im, job* j);
+};
+
+// Reads the file list into memory. Each reader takes the next file from the list in turn.
+void transcoder::read_stage() {
+	job* j;
+	int fd;
+	struct stat st;
+	ssize_t got;
+	
+	while (true) {
+		{
+			std::lock_guard<std::mutex> l(lock);
+			if (next_file >= files.size()) return;
+			
+			j = new job();
+			j->in = files[next_file];
+			j->out = outs[next_file];
+			next_file++;
+		}
+		j->start = std::chrono::steady_clock::now();
+		
+		fd = open(j->in.c_str(), O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			if (fd >= 0) close(fd);
+			fail(j, "Failed to open file", -1);
+			continue;
+		}
+		
+		j->file_len = st.st_size;
+		j->file = (unsigned char*) malloc(j->file_len > 0 ? j->file_len : 1);
+		
+		got = 0;
+		for (size_t off = 0; j->file != NULL && off < j->file_len; off += got) {
+			got = pread(fd, j->file + off, j->file_len - off, off);
+			if (got <= 0) break;
+		}
+		close(fd);
+		
+		if (j->file == NULL || (j->file_len > 0 && got <= 0)) {
+			fail(j, "Failed to read file", -1);
+			continue;
+		}
+		
+		to_decode.push(j);
+	}
+}
+
+void transcoder::decode_stage() {
+	job* j;
+	img::img* im;
+	FILE* fp;
+	int errcd;
+	
+	while (to_decode.pop(j)) {
+		im = new img::img();
+		
+		fp = fmemopen(j->file, j->file_len, "rb");
+		if (fp == NULL || img::img::load_png(fp, (char*) j->in.c_str(), *im, opts, -1, &errcd) == NULL) {
+			if (fp == NULL) errcd = -2;
+			else fclose(fp);
+			
+			delete im;
+			fail(j, verbose && errcd <= -1 && errcd >= -6 ? decode_errors[-errcd] : decode_errors[0], errcd);
+			continue;
+		}
+		fclose(fp);
+		
+		// The input is not needed anymore, so it is released before the output is allocated.
+		free(j->file);
+		j->file = NULL;
+		
+		if (!convert(*im, j)) {
+			delete im;
+			fail(j, "Failed to allocate output", -6);
+			continue;
+		}
+		delete im;
+		
+		to_write.push(j);
+	}
+}
+
+void transcoder::write_stage() {
+	job* j;
+	int fd;
+	ssize_t put;
+	size_t off;
+	
+	while (to_write.pop(j)) {
+		fd = open(j->out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			fail(j, "Failed to create output file", -1);
+			continue;
+		}
+		
+		put = 0;
+		for (off = 0; off < j->px_len; off += put) {
+			put = pwrite(fd, j->px + off, j->px_len - off, off);
+			if (put <= 0) break;
+		}
+		
+		if (close(fd) != 0 || off < j->px_len) {
+			fail(j, "Failed to write output file", -1);
+			continue;
+		}
+		
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - j->start).count();
+		{
+			std::lock_guard<std::mutex> l(lock);
+			latency.push_back(ms);
+			bytes_in += j->file_len;
+			bytes_out += j->px_len;
+		}
+		delete j;
+	}
+}
+
+void transcoder::fail(job* j, const char* why, int errcd) {
+	fprintf(stderr, "%s: %s (errcd %d)\n", j->in.c_str(), why, errcd);
+	
+	std::lock_guard<std::mutex> l(lock);
+	failed++;
+	delete j;
+}
+
+std::string transcoder::output_name(const std::string& in) {
+	size_t slash = in.find_last_of('/');
+	std::string base = slash == std::string::npos ? in : in.substr(slash + 1);
+	size_t dot = base.find_last_of('.');
+	if (dot != std::string::npos && dot > 0) base.resize(dot);
+	return out_dir + "/" + base + extensions[format];
+}
+
+bool transcoder::convert(const img::img& im, job* j) {
+	// Every format stores RGB(A) samples of the image's own size, 16 bit samples are big-endian.
+	bool wide = im.bit_depth == 16;
+	unsigned int maxval = wide ? 65535 : 255;
+	unsigned char rgba_bpp = wide ? 8 : 4;
+	unsigned char out_bpp = format == FORMAT_PPM ? rgba_bpp / 4 * 3 : rgba_bpp;
+	
+	char header[160];
+	int header_len = 0;
+	if (format == FORMAT_PPM) {
+		header_len = snprintf(header, 160, "P6\n%u %u\n%u\n", im.width, im.height, maxval);
+	} else if (format == FORMAT_PAM) {
+		header_len = snprintf(header, 160, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL %u\nTUPLTYPE RGB_ALPHA\nENDHDR\n", im.width, im.height, maxval);
+	}
+	
+	size_t pitch = (size_t) im.width * out_bpp;
+	j->px_len = header_len + pitch * im.height;
+	j->px = (unsigned char*) malloc(j->px_len);
+	unsigned char* row = format == FORMAT_PPM ? (unsigned char*) malloc((size_t) im.width * rgba_bpp) : NULL;
+	if (j->px == NULL || (format == FORMAT_PPM && row == NULL)) {
+		free(row);
+		return false;
+	}
+	memcpy(j->px, header, header_len);
+	
+	unsigned char color_type;
+	if (im.uses_palette) {
+		color_type = 3;
+	} else if (im.is_RGB) {
+		color_type = im.alpha_mode == 1 ? 6 : 2;
+	} else {
+		color_type = im.alpha_mode == 1 ? 4 : 0;
+	}
+	
+	// Transparency from a tRNS chunk. The converter takes the transparent gray or RGB value as 16 bit numbers.
+	unsigned short trns_key[3] = {0, 0, 0};
+	if (im.alpha_mode == 3) {
+		for (int i = 0; i < im.trns_length / 2; i++) {
+			trns_key[i] = im.trns[2*i] << 8 | im.trns[2*i + 1];
+		}
+	}
+	
+	// Rows of a decoded image are laid out as PNG scanlines, so the APNG row converter can be reused. Every row is passed as the only row of a single pass.
+	unsigned char* pixels = j->px + header_len;
+	img::apng_rgba_sink sink(row != NULL ? row : pixels, pitch, color_type, im.bit_depth, im.palette, im.palette != NULL ? im.palette_length : 0, im.trns, im.trns != NULL ? im.trns_length : 0, trns_key);
+	
+	img::png_pass pass;
+	pass.x0 = 0;
+	pass.y0 = 0;
+	pass.dx = 1;
+	pass.dy = 1;
+	pass.width = im.width;
+	pass.height = im.height;
+	
+	for (unsigned int y = 0; y < im.height; y++) {
+		if (row == NULL) {
+			sink.row(pass, y, im.data + (size_t) y * im.pitch);
+			continue;
+		}
+		
+		// PPM has no alpha channel.
+		sink.row(pass, 0, im.data + (size_t) y * im.pitch);
+		unsigned char* out = pixels + (size_t) y * pitch;
+		for (unsigned int x = 0; x < im.width; x++) {
+			memcpy(out + (size_t) x * out_bpp, row + (size_t) x * rgba_bpp, out_bpp);
+		}
+	}
+	
+	free(row);
+	return true;
+}
+
+size_t transcoder::run(const std::vector<std::string>& files) {
+	// Inputs with the same name in different directories (or listed twice) would be written to the same output. Only the first of them is converted, the others fail.
+	std::unordered_map<std::string, std::string> first;
+	this->files.clear();
+	outs.clear();
+	for (size_t i = 0; i < files.size(); i++) {
+		std::string out = output_name(files[i]);
+		std::pair<std::unordered_map<std::string, std::string>::iterator, bool> added = first.emplace(out, files[i]);
+		if (!added.second) {
+			fprintf(stderr, "%s: Skipped, its output file %s is the same as that of %s\n", files[i].c_str(), out.c_str(), added.first->second.c_str());
+			failed++;
+			continue;
+		}
+		this->files.push_back(files[i]);
+		outs.push_back(out);
+	}
+	next_file = 0;
+	
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	
+	std::vector<std::thread> read_pool;
+	std::vector<std::thread> decode_pool;
+	std::vector<std::thread> write_pool;
+	
+	for (unsigned int t = 0; t < readers; t++) read_pool.emplace_back(&transcoder::read_stage, this);
+	for (unsigned int t = 0; t < decoders; t++) decode_pool.emplace_back(&transcoder::decode_stage, this);
+	for (unsigned int t = 0; t < writers; t++) write_pool.emplace_back(&transcoder::write_stage, this);
+	
+	// Each stage is shut down once the stage before it has finished.
+	for (size_t t = 0; t < read_pool.size(); t++) read_pool[t].join();
+	to_decode.close();
+	for (size_t t = 0; t < decode_pool.size(); t++) decode_pool[t].join();
+	to_write.close();
+	for (size_t t = 0; t < write_pool.size(); t++) write_pool[t].join();
+	
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (secs <= 0) secs = 1e-9;
+	
+	std::sort(latency.begin(), latency.end());
+	size_t n = latency.size();
+	
+	printf("%zu files converted, %zu failed in %.3f s\n", n, failed, secs);
+	printf("%.1f files/s, %.1f MB/s in, %.1f MB/s out\n", n / secs, bytes_in / secs / 1e6, bytes_out / secs / 1e6);
+	if (n > 0) {
+		printf("latency per file: p50 %.2f ms, p99 %.2f ms\n", latency[(n - 1) * 50 / 100], latency[(n - 1) * 99 / 100]);
+	}
+	
+	return failed;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [options] -o OUTDIR (FILE | DIR)...\n", name);
+	fprintf(stderr, "Converts PNG files, or every .png file in a directory, to raw RGBA, PPM or PAM.\n\n");
+	fprintf(stderr, "  -o DIR    directory to write the converted files to\n");
+	fprintf(stderr, "  -f FMT    output format: raw (default), ppm or pam\n");
+	fprintf(stderr, "  -l FILE   also convert the files listed in FILE, one per line (- for stdin)\n");
+	fprintf(stderr, "  -j N      decoding threads, default one per hardware thread\n");
+	fprintf(stderr, "  -r N      reading threads, default 2\n");
+	fprintf(stderr, "  -w N      writing threads, default 2\n");
+	fprintf(stderr, "  -q N      files waiting between stages, default 2 per decoding thread\n");
+	fprintf(stderr, "  -t        trusted input, skip every CRC check\n");
+	fprintf(stderr, "  -v        describe why files failed to decode\n");
+}
+
+// Parse the argument of a numeric option. Returns false unless it is a whole number from 0 to max.
+static bool parse_count(int opt, const char* arg, size_t max, size_t* n) {
+	char* end;
+	errno = 0;
+	unsigned long long v = strtoull(arg, &end, 10);
+	
+	// strtoull() accepts a sign and leading white space, and negates negative numbers.
+	if (*arg < '0' || *arg > '9' || *end != 0 || errno != 0 || v > max) {
+		fprintf(stderr, "-%c: Expected a number from 0 to %zu, got \"%s\"\n", opt, max, arg);
+		return false;
+	}
+	*n = v;
+	return true;
+}
+
+// Add path to the list, or every .png file in it if it is a directory.
+static bool add_path(const std::string& path, std::vector<std::string>& files) {
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		fprintf(stderr, "%s: No such file or directory\n", path.c_str());
+		return false;
+	}
+	
+	if (!S_ISDIR(st.st_mode)) {
+		files.push_back(path);
+		return true;
+	}
+	
+	DIR* dir = opendir(path.c_str());
+	if (dir == NULL) {
+		fprintf(stderr, "%s: Failed to open directory\n", path.c_str());
+		return false;
+	}
+	
+	std::vector<std::string> found;
+	struct dirent* e;
+	size_t len;
+	while ((e = readdir(dir)) != NULL) {
+		len = strlen(e->d_name);
+		if (len > 4 && strcasecmp(e->d_name + len - 4, ".png") == 0) {
+			found.push_back(path + "/" + e->d_name);
+		}
+	}
+	closedir(dir);
+	
+	std::sort(found.begin(), found.end());
+	files.insert(files.end(), found.begin(), found.end());
+	return true;
+}
+
+static bool add_list(const char* fn, std::vector<std::string>& files) {
+	FILE* fp = strcmp(fn, "-") == 0 ? stdin : fopen(fn, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: Failed to open file list\n", fn);
+		return false;
+	}
+	
+	char* line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while ((len = getline(&line, &cap, fp)) >= 0) {
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = 0;
+		if (len > 0) files.push_back(line);
+	}
+	
+	free(line);
+	if (fp != stdin) fclose(fp);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	std::vector<std::string> files;
+	std::string out_dir;
+	out_format format = FORMAT_RAW;
+	
+	size_t decoders = std::thread::hardware_concurrency();
+	size_t readers = 2;
+	size_t writers = 2;
+	size_t depth = 0;
+	bool trusted = false;
+	bool verbose = false;
+	
+	int c;
+	while ((c = getopt(argc, argv, "o:f:l:j:r:w:q:tvh")) != -1) {
+		switch (c) {
+			case 'o':
+				out_dir = optarg;
+				break;
+			case 'f':
+				if (strcmp(optarg, "raw") == 0) {
+					format = FORMAT_RAW;
+				} else if (strcmp(optarg, "ppm") == 0) {
+					format = FORMAT_PPM;
+				} else if (strcmp(optarg, "pam") == 0) {
+					format = FORMAT_PAM;
+				} else {
+					usage(argv[0]);
+					return 2;
+				}
+				break;
+			case 'l':
+				if (!add_list(optarg, files)) return 2;
+				break;
+			case 'j':
+				if (!parse_count(c, optarg, IMG_TRANSCODE_MAX_THREADS, &decoders)) return 2;
+				break;
+			case 'r':
+				if (!parse_count(c, optarg, IMG_TRANSCODE_MAX_THREADS, &readers)) return 2;
+				break;
+			case 'w':
+				if (!parse_count(c, optarg, IMG_TRANSCODE_MAX_THREADS, &writers)) return 2;
+				break;
+			case 'q':
+				if (!parse_count(c, optarg, IMG_TRANSCODE_MAX_DEPTH, &depth)) return 2;
+				break;
+			case 't':
+				trusted = true;
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	
+	for (int i = optind; i < argc; i++) {
+		if (!add_path(argv[i], files)) return 2;
+	}
+	
+	if (out_dir.empty() || files.empty()) {
+		usage(argv[0]);
+		return 2;
+	}
+	
+	if (decoders == 0) decoders = 1;
+	if (readers == 0) readers = 1;
+	if (writers == 0) writers = 1;
+	if (depth == 0) depth = 2 * decoders;
+	
+	transcoder tc(depth);
+	tc.format = format;
+	tc.out_dir = out_dir;
+	tc.verbose = verbose;
+	tc.readers = readers;
+	tc.decoders = decoders;
+	tc.writers = writers;
+	if (trusted) tc.opts.trust = img::PNG_TRUST_ALL;
+	
+	return tc.run(files) > 0 ? 1 : 0;
+}
@@ -1,8 +1,8 @@
 namespace util {
 	/* binp_stream */
 	
-	binp_stream::binp_stream() : in(NULL), b(0), numbits(0), eof(false) {}
-	binp_stream::binp_stream(FILE* in) : in(in), b(0), numbits(0), eof(false) {}
+	binp_stream::binp_stream() : in(NULL), eof(false), b(0), numbits(0) {}
+	binp_stream::binp_stream(FILE* in) : in(in), eof(false), b(0), numbits(0) {}
 	
 	unsigned char binp_stream::read_1() {
 		// If there are no more bits in the current byte, get the next byte.
@@ -125,93 +125,470 @@ namespace util {
 		return true;
 	}
 	
+	/* huffman_table */
+	
+	huffman_table::huffman_table() {
+		memset(count, 0, sizeof(count));
+		memset(fast, 0, sizeof(fast));
+	}
+	
+	bool huffman_table::build(const unsigned char* lengths, unsigned int n) {
+		unsigned short offs[MAX_BITS + 2];
+		unsigned short next[MAX_BITS + 1];
+		
+		memset(count, 0, sizeof(count));
+		memset(fast, 0, sizeof(fast));
+		for (unsigned int s = 0; s < n; s++) {
+			count[lengths[s]]++;
+		}
+		count[0] = 0;
+		
+		// A code is over-subscribed if more codes of some length are needed than are left over by the shorter ones.
+		int left = 1;
+		for (unsigned int len = 1; len <= MAX_BITS; len++) {
+			left <<= 1;
+			left -= count[len];
+			if (left < 0) return false;
+		}
+		
+		// Codes of each length start where those of the previous length end. Symbols of the same length get consecutive codes in the order of the symbols.
+		unsigned int code = 0;
+		offs[1] = 0;
+		for (unsigned int len = 1; len <= MAX_BITS; len++) {
+			offs[len + 1] = offs[len] + count[len];
+			next[len] = code;
+			code = (code + count[len]) << 1;
+		}
+		
+		for (unsigned int s = 0; s < n; s++) {
+			unsigned int len = lengths[s];
+			if (len == 0) continue;
+			
+			symbol[offs[len]++] = s;
+			
+			// Deflate stores codes starting with their most significant bit, so the table is indexed by the reversed code, and every entry starting with it is filled.
+			code = next[len]++;
+			if (len <= FAST_BITS) {
+				unsigned int rev = 0;
+				for (unsigned int i = 0; i < len; i++) {
+					rev = (rev << 1) | ((code >> i) & 1);
+				}
+				for (unsigned int i = rev; i < (1u << FAST_BITS); i += 1u << len) {
+					fast[i] = (s << 4) | len;
+				}
+			}
+		}
+		
+		return true;
+	}
+	
+	int huffman_table::decode(unsigned int bits, unsigned int& len) const {
+		unsigned short e = fast[bits & ((1 << FAST_BITS) - 1)];
+		if (e != 0) {
+			len = e & 0xF;
+			return e >> 4;
+		}
+		
+		// Walk the code one bit at a time. At each length, the codes of that length are first to first + count[len] - 1.
+		int code = 0;
+		int first = 0;
+		int index = 0;
+		for (len = 1; len <= MAX_BITS; len++) {
+			code |= (bits >> (len - 1)) & 1;
+			if (code - first < count[len]) {
+				return symbol[index + code - first];
+			}
+			index += count[len];
+			first += count[len];
+			first <<= 1;
+			code <<= 1;
+		}
+		len = 0;
+		return -1;
+	}
+	
 	/* zlib_stream */
 	
-	zlib_stream::zlib_stream() : in(), out(), zhead(0), BTYPE(3), BFINAL(1) {}
-	zlib_stream::zlib_stream(FILE* in, FILE* out) : in(in), out(out), zhead(0), BTYPE(3), BFINAL(1) {}
+	// Base lengths and distances of the length and distance symbols, and how many extra bits follow each.
+	static const unsigned short zlib_len_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	static const unsigned char zlib_len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	static const unsigned short zlib_dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+	static const unsigned char zlib_dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+	
+	// Order in which the code lengths of the code length alphabet are stored.
+	static const unsigned char zlib_clen_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
 	
-	void zlib_stream::set_in(FILE* fp) {in.in = fp;}
+	zlib_stream::zlib_stream() : zlib_stream(NULL, NULL) {}
+	zlib_stream::zlib_stream(FILE* in, FILE* out) : in(in), out(out), zhead(0), BFINAL(0), BTYPE(3), trailer(false), done(false), failed(false), stored_left(0), ibuf(NULL), ilen(0), icap(0), bp(0), win(NULL), wlen(0), wflushed(0), adler_a(1), adler_b(0) {}
+	
+	void zlib_stream::set_in(FILE* fp) {in = binp_stream(fp);}
 	void zlib_stream::set_out(FILE* fp) {out.out = fp;}
 	
-	bool zlib_stream::deflate(unsigned int bytes) {printf("Deflate not yet implemented.\n");}
+	bool zlib_stream::deflate(unsigned int) {
+		printf("Deflate not yet implemented.\n");
+		return false;
+	}
 	
 	bool zlib_stream::inflate(unsigned int bytes) {
+		if (failed) return false;
+		
+		// Drop the input which has been decoded, and append the new input after the rest.
+		size_t used = bp >> 3;
+		if (used > 0) {
+			memmove(ibuf, ibuf + used, ilen - used);
+			ilen -= used;
+			bp &= 7;
+		}
+		if (ilen + bytes > icap || ibuf == NULL) {
+			size_t cap = ilen + bytes > 2 * icap ? ilen + bytes : 2 * icap;
+			unsigned char* nbuf = (unsigned char*) realloc(ibuf, cap + 8);
+			if (nbuf == NULL) {
+				failed = true;
+				return false;
+			}
+			ibuf = nbuf;
+			icap = cap;
+		}
+		if (win == NULL) {
+			win = (unsigned char*) malloc(WINDOW_SIZE);
+			if (win == NULL) {
+				failed = true;
+				return false;
+			}
+		}
+		
+		size_t got = 0;
+		if (in.in != NULL && bytes > 0) {
+			got = fread(ibuf + ilen, 1, bytes, in.in);
+		}
+		if (got < bytes) in.eof = true;
+		ilen += got;
+		memset(ibuf + ilen, 0, 8);
+		
+		if (!run()) failed = true;
+		flush();
+		
+		return !failed;
+	}
+	
+	bool zlib_stream::finished() const {return done;}
+	
+	void zlib_stream::close_in() {
+		if (in.in != NULL) fclose(in.in);
+		in.in = NULL;
+	}
+	
+	void zlib_stream::close_out() {
+		if (out.out != NULL) fclose(out.out);
+		out.out = NULL;
+	}
+	
+	zlib_stream::~zlib_stream() {
+		free(ibuf);
+		free(win);
+	}
+	
+	unsigned int zlib_stream::peek() const {
+		size_t i = bp >> 3;
+		if (i > ilen) return 0;
+		
+		unsigned long long v = 0;
+		for (int k = 7; k >= 0; k--) {
+			v = (v << 8) | ibuf[i + k];
+		}
+		return (unsigned int) (v >> (bp & 7));
+	}
+	
+	unsigned int zlib_stream::bits(unsigned char n) {
+		unsigned int v = peek() & ((1u << n) - 1);
+		bp += n;
+		return v;
+	}
+	
+	bool zlib_stream::run() {
 		// Read zlib stream header
 		if (zhead == 0) {
-			zhead = in.read_8() << 8 | in.read_8();
+			if (ilen * 8 < bp + 16) return true;
+			zhead = bits(8) << 8;
+			zhead |= bits(8);
 			
 			CM = (zhead & 0x0F00) >> 8;
 			CINFO = (zhead & 0xF000) >> 12;
 			FDICT = (zhead & 0x0020) >> 5;
-			FLEVEL = (zhead & 0x0070) >> 6;
+			FLEVEL = (zhead & 0x00C0) >> 6;
 			
-			// Check for invalid zhead values
+			// Check for invalid zhead values. Preset dictionaries are not supported.
 			if (CINFO > 7 || CM != 8 || zhead % 31 != 0 || FDICT) return false;
-			
-			unsigned short window_size = 1 << (CINFO + 8);
 		}
 		
-		unsigned int bytes_left = bytes;
-		
-		// Decompress stream
-		while (!BFINAL & !in.eof) {
-			// Read deflate block header
-			BFINAL = in.read_1();
-			BTYPE = in.read_bits(2);
-			
-			if (BTYPE == 0) {
-				inflate_block_none(bytes);
+		while (!done) {
+			if (trailer) {
+				// The Adler-32 of the data follows the last block, starting at the next byte boundary.
+				bp = (bp + 7) & ~(size_t) 7;
+				if (ilen * 8 < bp + 32) return true;
+				
+				flush();
+				unsigned int adler32_r = bits(8) << 24;
+				adler32_r |= bits(8) << 16;
+				adler32_r |= bits(8) << 8;
+				adler32_r |= bits(8);
+				if (adler32_r != ((adler_b << 16) | adler_a)) return false;
+				
+				done = true;
 			}
-			else if (BTYPE == 1) {
-				inflate_block_fixed(bytes);
+			else if (BTYPE == 3) {
+				if (!inflate_block_header()) return false;
+				if (BTYPE == 3) return true;
 			}
-			else if (BTYPE == 2) {
-				inflate_block_dynamic(bytes);
+			else if (BTYPE == 0) {
+				if (!inflate_block_none()) return false;
+				if (BTYPE == 0) return true;
 			}
 			else {
-				return false;
+				if (!inflate_block_codes()) return false;
+				if (BTYPE != 3) return true;
 			}
 		}
 		
 		return true;
 	}
 	
-	void zlib_stream::close_in() {
-		fclose(in.in);
-	}
-	
-	void zlib_stream::close_out() {
-		fclose(out.out);
+	bool zlib_stream::inflate_block_header() {
+		size_t save = bp;
+		size_t limit = ilen * 8;
+		
+		bool last = bits(1);
+		unsigned char type = bits(2);
+		if (bp > limit) {
+			bp = save;
+			return true;
+		}
+		
+		if (type == 0) {
+			// Stored blocks start at the next byte boundary with their length and its complement.
+			bp = (bp + 7) & ~(size_t) 7;
+			unsigned int len = bits(16);
+			unsigned int nlen = bits(16);
+			if (bp > limit) {
+				bp = save;
+				return true;
+			}
+			if (len != (~nlen & 0xFFFF)) return false;
+			stored_left = len;
+		}
+		else if (type == 1) {
+			unsigned char lengths[288 + 30];
+			memset(lengths, 8, 144);
+			memset(lengths + 144, 9, 112);
+			memset(lengths + 256, 7, 24);
+			memset(lengths + 280, 8, 8);
+			memset(lengths + 288, 5, 30);
+			lit.build(lengths, 288);
+			dist.build(lengths + 288, 30);
+		}
+		else if (type == 2) {
+			// A header which is cut off sets bp back to save.
+			if (!inflate_block_dynamic_header()) return false;
+			if (bp == save) return true;
+		}
+		else {
+			return false;
+		}
+		
+		BFINAL = last;
+		BTYPE = type;
+		return true;
 	}
 	
-	bool zlib_stream::inflate_block_none(unsigned int bytes) {
-		unsigned short len = in.read_16();
-		unsigned short nlen = in.read_16();
+	bool zlib_stream::inflate_block_dynamic_header() {
+		// The block header bits have been read. On a short read, bp is set back to before them.
+		size_t save = bp - 3;
+		size_t limit = ilen * 8;
+		
+		unsigned int hlit = bits(5) + 257;
+		unsigned int hdist = bits(5) + 1;
+		unsigned int hclen = bits(4) + 4;
+		if (hlit > 286 || hdist > 30) {
+			if (bp > limit) {
+				bp = save;
+				return true;
+			}
+			return false;
+		}
 		
-		unsigned int a = 1;
-		unsigned int b = 0;
+		unsigned char clen[19] = {0};
+		for (unsigned int i = 0; i < hclen; i++) {
+			clen[zlib_clen_order[i]] = bits(3);
+		}
+		if (bp > limit) {
+			bp = save;
+			return true;
+		}
 		
-		unsigned char c;
+		huffman_table ct;
+		if (!ct.build(clen, 19)) return false;
 		
-		// Copy uncompressed data to output stream
-		for (int i = 0; i < len; i++) {
-			c = in.read_8();
-			a = (a+c) % 65521;
-			b = (b+a) % 65521;
-			out.write_8(c);
+		// The code lengths of both codes form a single sequence, in which 16 repeats the previous length and 17 and 18 repeat a 0.
+		unsigned char lengths[286 + 30];
+		unsigned int n = 0;
+		unsigned int len;
+		while (n < hlit + hdist) {
+			int sym = ct.decode(peek(), len);
+			bp += len;
+			
+			unsigned int rep = 1;
+			unsigned char val = sym;
+			if (sym == 16) {
+				rep = 3 + bits(2);
+				val = n > 0 ? lengths[n - 1] : 0;
+			} else if (sym == 17) {
+				rep = 3 + bits(3);
+				val = 0;
+			} else if (sym == 18) {
+				rep = 11 + bits(7);
+				val = 0;
+			}
+			
+			if (bp > limit) {
+				bp = save;
+				return true;
+			}
+			if (sym < 0 || (sym == 16 && n == 0) || n + rep > hlit + hdist) return false;
+			
+			memset(lengths + n, val, rep);
+			n += rep;
 		}
 		
-		unsigned int adler32_c = (a << 16) | b;
-		unsigned int adler32_r = (in.read_8() << 8) | in.read_8() | (in.read_8() << 24) | (in.read_8() << 16);
+		// A block without an end-of-block code could never end.
+		if (lengths[256] == 0) return false;
+		
+		if (!lit.build(lengths, hlit)) return false;
+		if (!dist.build(lengths + hlit, hdist)) return false;
+		
+		return true;
+	}
+	
+	bool zlib_stream::inflate_block_none() {
+		size_t n;
 		
-		if (adler32_c != adler32_r) return false;
+		// Copy uncompressed data to the window, as far as the input goes.
+		while (stored_left > 0) {
+			n = ilen - (bp >> 3);
+			if (n == 0) return true;
+			
+			if (WINDOW_SIZE - wlen < MAX_MATCH) flush();
+			if (n > stored_left) n = stored_left;
+			if (n > WINDOW_SIZE - wlen) n = WINDOW_SIZE - wlen;
+			
+			memcpy(win + wlen, ibuf + (bp >> 3), n);
+			wlen += n;
+			bp += n * 8;
+			stored_left -= n;
+		}
 		
+		trailer = BFINAL;
+		BTYPE = 3;
 		return true;
 	}
 	
-	bool zlib_stream::inflate_block_fixed(unsigned int bytes) {}
+	bool zlib_stream::inflate_block_codes() {
+		size_t limit = ilen * 8;
+		size_t save;
+		unsigned int len;
+		int sym;
+		int dsym;
+		unsigned int length;
+		unsigned int distance;
+		
+		while (true) {
+			if (WINDOW_SIZE - wlen < MAX_MATCH) flush();
+			
+			// Each literal or length/distance pair is decoded completely before anything is written, so that it can be read again if it was cut off.
+			save = bp;
+			sym = lit.decode(peek(), len);
+			bp += len;
+			
+			if (sym < 256) {
+				if (bp > limit) {
+					bp = save;
+					return true;
+				}
+				if (sym < 0) return false;
+				
+				win[wlen++] = sym;
+				continue;
+			}
+			
+			if (sym == 256) {
+				if (bp > limit) {
+					bp = save;
+					return true;
+				}
+				trailer = BFINAL;
+				BTYPE = 3;
+				return true;
+			}
+			
+			sym -= 257;
+			length = 0;
+			distance = 0;
+			dsym = -1;
+			if (sym < 29) {
+				length = zlib_len_base[sym] + bits(zlib_len_extra[sym]);
+				dsym = dist.decode(peek(), len);
+				bp += len;
+				if (dsym >= 0 && dsym < 30) {
+					distance = zlib_dist_base[dsym] + bits(zlib_dist_extra[dsym]);
+				}
+			}
+			
+			if (bp > limit) {
+				bp = save;
+				return true;
+			}
+			if (sym >= 29 || dsym < 0 || dsym >= 30 || distance > wlen) return false;
+			
+			// The copy may overlap the data it produces, in which case it repeats the last "distance" bytes.
+			unsigned char* dst = win + wlen;
+			const unsigned char* src = dst - distance;
+			if (distance >= length) {
+				memcpy(dst, src, length);
+			} else {
+				for (unsigned int i = 0; i < length; i++) {
+					dst[i] = src[i];
+				}
+			}
+			wlen += length;
+		}
+	}
 	
-	bool zlib_stream::inflate_block_dynamic(unsigned int bytes) {}
+	void zlib_stream::flush() {
+		size_t n = wlen - wflushed;
+		if (n > 0) {
+			if (out.out != NULL) fwrite(win + wflushed, 1, n, out.out);
+			
+			// The sums are reduced before they can overflow, every 5552 bytes at most.
+			const unsigned char* p = win + wflushed;
+			while (n > 0) {
+				size_t k = n < 5552 ? n : 5552;
+				n -= k;
+				while (k-- > 0) {
+					adler_a += *p++;
+					adler_b += adler_a;
+				}
+				adler_a %= 65521;
+				adler_b %= 65521;
+			}
+			wflushed = wlen;
+		}
+		
+		// Only the last WINDOW bytes can be referred to by later blocks.
+		if (WINDOW_SIZE - wlen < MAX_MATCH && wlen > WINDOW) {
+			memmove(win, win + wlen - WINDOW, WINDOW);
+			wlen = WINDOW;
+			wflushed = WINDOW;
+		}
+	}
 	
 	unsigned char zlib_stream::decode_symbol(const huffman_tree& ht) {
 		unsigned char b;
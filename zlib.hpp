@@ -4,6 +4,8 @@
 #define util_zlib
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 namespace util {
 	// This class allows the reading of individual bits and bytes from a file stream.
@@ -81,6 +83,34 @@ namespace util {
 		bool insert(unsigned short codeword, unsigned char n, unsigned char symbol);
 	};
 	
+	// A canonical Huffman code, as used by deflate. Codes of up to 9 bits are decoded with a single table lookup, longer ones bit by bit.
+	class huffman_table {
+	public:
+		huffman_table();
+		
+		// Build the code from the code length of each of n symbols, 0 meaning the symbol is unused. Returns false if the lengths do not describe a prefix code.
+		// Incomplete codes are accepted, deflate uses them for blocks with a single distance code. Their unused codes decode as invalid.
+		bool build(const unsigned char* lengths, unsigned int n);
+		
+		// Decode the symbol at the start of bits, which holds the next input bits starting with the least significant one.
+		// Sets len to the length of its code and returns the symbol, or returns -1 if bits do not start with a valid code.
+		int decode(unsigned int bits, unsigned int& len) const;
+		
+		static const unsigned int MAX_BITS = 15;
+		static const unsigned int MAX_SYMBOLS = 288;
+		static const unsigned int FAST_BITS = 9;
+		
+	private:
+		// Number of codes of each length.
+		unsigned short count[MAX_BITS + 1];
+		
+		// Symbols sorted by their codes.
+		unsigned short symbol[MAX_SYMBOLS];
+		
+		// Indexed by the next FAST_BITS input bits. Holds (symbol << 4) | length for codes which fit, 0 otherwise.
+		unsigned short fast[1 << FAST_BITS];
+	};
+	
 	// This class keeps track of the internal state of a zlib stream, allowing the user to decode or encode streams as they become available.
 	// deflate() and inflate() will continue encoding the stream from wherever the cursor happens to be and from wherever they left off last time they were called.
 	class zlib_stream {
@@ -88,17 +118,31 @@ namespace util {
 		zlib_stream();
 		zlib_stream(FILE* in, FILE* out);
 		
+		zlib_stream(const zlib_stream&) = delete;
+		zlib_stream& operator=(const zlib_stream&) = delete;
+		
+		// Switch to another input stream. Input which has been read from the previous one but not decoded yet is kept, so a zlib stream may be split across several files, such as PNG IDAT chunks.
 		void set_in(FILE* in);
 		void set_out(FILE* out);
 		
+		// Not implemented, always returns false.
 		bool deflate(unsigned int bytes);
+		
+		// Read up to "bytes" bytes from the input stream and write everything that can be decoded from them to the output stream.
+		// A stream cut off in the middle of a code is resumed by the next call. Returns false if the stream is invalid or its checksum does not match, and from then on.
 		bool inflate(unsigned int bytes);
 		
+		// Whether the end of the stream has been reached and its checksum verified.
+		bool finished() const;
+		
 		// Close streams.
 		void close_in();
 		void close_out();
 		
-unsigned char decode_symbol(const huffman_tree& ht);
+		// reads the next huffman code from the input stream and returns the associated symbol
+		unsigned char decode_symbol(const huffman_tree& ht);
+		
+		~zlib_stream();
 		
 	private:
 		// Input and output bit streams
@@ -118,14 +162,55 @@ unsigned char decode_symbol(const huffman_tree& ht);
 		bool BFINAL;
 		unsigned char BTYPE;
 		
-		// Functions to handle individual deflate blocks.
-		// Functions will decode up to "bytes" bytes, or until they reach the end of the block, or until EOF.
-		bool inflate_block_none(unsigned int bytes);
-		bool inflate_block_fixed(unsigned int bytes);
-		bool inflate_block_dynamic(unsigned int bytes);
+		// Whether the checksum at the end of the stream is expected, has been verified, or the stream was found to be invalid.
+		bool trailer;
+		bool done;
+		bool failed;
+		
+		// Bytes left in the current stored block.
+		unsigned int stored_left;
+		
+		// Codes of the current compressed block.
+		huffman_table lit;
+		huffman_table dist;
+		
+		// Input read but not yet decoded, followed by 8 zero bytes so that peek() never reads past it. bp is the position of the next bit.
+		unsigned char* ibuf;
+		size_t ilen;
+		size_t icap;
+		size_t bp;
+		
+		// Decoded data. Everything before wflushed has been written to the output stream, and the last WINDOW bytes of it are kept for back-references.
+		unsigned char* win;
+		size_t wlen;
+		size_t wflushed;
 		
-		// reads the next huffman code and returns the associated symbol
-//		unsigned char decode_symbol(const huffman_tree& ht);
+		// Running Adler-32 of the data written to the output stream.
+		unsigned int adler_a;
+		unsigned int adler_b;
+		
+		static const size_t WINDOW = 32768;
+		static const size_t WINDOW_SIZE = 4 * 32768;
+		static const size_t MAX_MATCH = 258;
+		
+		// Returns the next 32 input bits, starting with the least significant one. Bits past the end of the input read as 0.
+		unsigned int peek() const;
+		
+		// Consume n bits (at most 16) and return them.
+		unsigned int bits(unsigned char n);
+		
+		// Decode as much of the stream as the input read so far allows. Returns false if it is invalid.
+		bool run();
+		
+		// Functions to handle individual deflate blocks.
+		// Each one decodes until it reaches the end of the block or the end of the input read so far. Units which are cut off are rolled back and decoded again once more input is available.
+		bool inflate_block_header();
+		bool inflate_block_none();
+		bool inflate_block_dynamic_header();
+		bool inflate_block_codes();
+		
+		// Write the decoded data to the output stream, and make room in the window if it is nearly full.
+		void flush();
 	};
 }
 